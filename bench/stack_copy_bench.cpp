@@ -0,0 +1,186 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+// Compares the two ways the async sampler has kept copied stacks: the original volatile byte
+// array, where every word read is put back together from eight single byte loads, and the
+// aligned word array it uses now, where a read is one load by index. Both copy the same
+// synthetic stack and walk the same RBP chain over it, so this needs no runtime.
+//
+// Usage: stackcopybench [iterations]
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static constexpr size_t StackCaptureBytes = 32768;
+static constexpr size_t StackCaptureWords = StackCaptureBytes / sizeof(uintptr_t);
+
+// 24KB of stack in 240 byte frames, about what a deep ASP.NET request looks like
+static constexpr size_t StackDepthBytes = 24576;
+static constexpr size_t FrameBytes = 240;
+
+struct ByteSlot
+{
+    std::array<volatile uint8_t, StackCaptureBytes> stack;
+    uintptr_t stackBase;
+    uintptr_t startIndex;
+};
+
+struct WordSlot
+{
+    alignas(64) std::array<uintptr_t, StackCaptureWords> stack;
+    uintptr_t stackBase;
+    uint32_t startIndex;
+};
+
+union Int64Parser
+{
+    uint64_t i;
+    uint8_t bytes[8];
+};
+
+static uintptr_t MapStackAddressToLocalOffset(const ByteSlot *slot, uintptr_t address)
+{
+    return slot->stack.size() - (slot->stackBase - address);
+}
+
+static uintptr_t ReadPtrSlotFromStack(const ByteSlot *slot, uintptr_t offset)
+{
+    Int64Parser parser;
+    for (int i = 7; i >= 0; --i)
+    {
+        parser.bytes[i] = slot->stack[offset + i];
+    }
+
+    return parser.i;
+}
+
+// Same checks as AsyncSampler::GetStackWordIndex
+static uint32_t GetStackWordIndex(const WordSlot *slot, uintptr_t address)
+{
+    uintptr_t offsetFromStackBase = slot->stackBase - address;
+    if (address >= slot->stackBase
+        || offsetFromStackBase > StackCaptureWords * sizeof(uintptr_t)
+        || (address & (sizeof(uintptr_t) - 1)) != 0)
+    {
+        return StackCaptureWords;
+    }
+
+    uint32_t index = StackCaptureWords - (uint32_t)(offsetFromStackBase / sizeof(uintptr_t));
+    return index >= slot->startIndex ? index : StackCaptureWords;
+}
+
+static double NsPerIteration(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, int iterations)
+{
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    // Build a stack whose frames link up to the base like a real RBP chain, with a fake
+    // return address above each saved RBP
+    static uintptr_t liveStack[StackCaptureWords];
+    uintptr_t stackBase = (uintptr_t)(liveStack + StackCaptureWords);
+    uintptr_t stackTop = stackBase - StackDepthBytes;
+    std::vector<uintptr_t> framePointers;
+    for (uintptr_t rbp = stackTop + 16; rbp + FrameBytes + 16 < stackBase; rbp += FrameBytes)
+    {
+        framePointers.push_back(rbp);
+    }
+
+    for (size_t i = 0; i < framePointers.size(); ++i)
+    {
+        uintptr_t *frame = (uintptr_t *)framePointers[i];
+        frame[0] = i + 1 < framePointers.size() ? framePointers[i + 1] : 0;
+        frame[1] = 0x400000 + i;
+    }
+
+    static ByteSlot byteSlot;
+    static WordSlot wordSlot;
+    volatile uintptr_t sink = 0;
+    size_t byteFrames = 0;
+    size_t wordFrames = 0;
+
+    auto byteCopyStart = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; ++n)
+    {
+        uintptr_t size = stackBase - stackTop;
+        uintptr_t startIndex = byteSlot.stack.size() - size;
+        memcpy((void *)&byteSlot.stack[startIndex], (const void *)stackTop, size);
+        byteSlot.stackBase = stackBase;
+        byteSlot.startIndex = startIndex;
+        sink += byteSlot.stack[startIndex];
+    }
+
+    auto byteWalkStart = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; ++n)
+    {
+        uintptr_t offset = MapStackAddressToLocalOffset(&byteSlot, framePointers[0]);
+        while (true)
+        {
+            sink += ReadPtrSlotFromStack(&byteSlot, offset + 8);
+            ++byteFrames;
+
+            offset = MapStackAddressToLocalOffset(&byteSlot, ReadPtrSlotFromStack(&byteSlot, offset));
+            if (offset < byteSlot.startIndex || offset >= byteSlot.stack.size())
+            {
+                break;
+            }
+        }
+    }
+
+    auto wordCopyStart = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; ++n)
+    {
+        uint32_t copyWords = (uint32_t)std::min<uintptr_t>((stackBase - stackTop) / sizeof(uintptr_t), StackCaptureWords);
+        uint32_t startIndex = StackCaptureWords - copyWords;
+        memcpy(&wordSlot.stack[startIndex], (const void *)stackTop, copyWords * sizeof(uintptr_t));
+        wordSlot.stackBase = stackTop + copyWords * sizeof(uintptr_t);
+        wordSlot.startIndex = startIndex;
+        sink += wordSlot.stack[startIndex];
+    }
+
+    auto wordWalkStart = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; ++n)
+    {
+        uint32_t index = GetStackWordIndex(&wordSlot, framePointers[0]);
+        while (index + 1 < StackCaptureWords)
+        {
+            sink += wordSlot.stack[index + 1];
+            ++wordFrames;
+
+            uint32_t next = GetStackWordIndex(&wordSlot, wordSlot.stack[index]);
+            if (next <= index)
+            {
+                break;
+            }
+
+            index = next;
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    printf("%zu byte stack, %zu frames per walk (byte array %zu, word array %zu), %d iterations\n",
+        StackDepthBytes,
+        framePointers.size(),
+        byteFrames / iterations,
+        wordFrames / iterations,
+        iterations);
+    printf("               copy      walk\n");
+    printf("byte array  %6.0f ns %6.0f ns\n", NsPerIteration(byteCopyStart, byteWalkStart, iterations), NsPerIteration(byteWalkStart, wordCopyStart, iterations));
+    printf("word array  %6.0f ns %6.0f ns\n", NsPerIteration(wordCopyStart, wordWalkStart, iterations), NsPerIteration(wordWalkStart, end, iterations));
+    return 0;
+}
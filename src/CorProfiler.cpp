@@ -41,13 +41,23 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
         return E_FAIL;
     }
 
-    corProfilerInfo->SetEventMask2(COR_PRF_ENABLE_STACK_SNAPSHOT |
-                                   COR_PRF_MONITOR_JIT_COMPILATION |
-                                   COR_PRF_MONITOR_THREADS |
-                                   COR_PRF_MONITOR_MODULE_LOADS,
-                                   0);
+    bool async = ReadEnvironmentVariable("STACKSAMPLER_ASYNC") != "";
 
-    if (ReadEnvironmentVariable("STACKSAMPLER_ASYNC") != "")
+    DWORD eventMask = COR_PRF_ENABLE_STACK_SNAPSHOT |
+                      COR_PRF_MONITOR_JIT_COMPILATION |
+                      COR_PRF_MONITOR_THREADS |
+                      COR_PRF_MONITOR_MODULE_LOADS;
+    if (async)
+    {
+        // Only the async sampler keeps a code range table, and it needs to hear about ready
+        // to run code too. There's a callback for every cache search, so don't pay for it
+        // otherwise.
+        eventMask |= COR_PRF_MONITOR_CACHE_SEARCHES;
+    }
+
+    corProfilerInfo->SetEventMask2(eventMask, 0);
+
+    if (async)
     {
         printf("Using asynchronous stack sampling\n");
 
@@ -67,6 +77,12 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
 
 HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
 {
+    // The sampling thread uses corProfilerInfo, so it has to be gone first
+    if (this->sampler != nullptr)
+    {
+        this->sampler->Shutdown();
+    }
+
     if (this->corProfilerInfo != nullptr)
     {
         this->corProfilerInfo->Release();
@@ -129,7 +145,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadStarted(ModuleID moduleId)
         return S_OK;
     }
 
-    m_moduleMetadata.insertNew(moduleId, pMDImport);
+    m_moduleMetadata.Insert(moduleId, pMDImport);
 
     return S_OK;
 }
@@ -141,6 +157,11 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadFinished(ModuleID moduleId, HRE
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
 {
+    // Stops new lookups finding it, the sampling thread releases the metadata once it's sure
+    // it isn't using it any more
+    m_moduleMetadata.Remove(moduleId);
+    sampler->ModuleUnloaded(moduleId);
+
     return S_OK;
 }
 
@@ -187,6 +208,12 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID function
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
 {
     ++jitEventCount;
+
+    if (SUCCEEDED(hrStatus))
+    {
+        sampler->FunctionCompiled(functionId, 0);
+    }
+
     return S_OK;
 }
 
@@ -197,6 +224,12 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITCachedFunctionSearchStarted(FunctionID
 
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCachedFunctionSearchFinished(FunctionID functionId, COR_PRF_JIT_CACHE result)
 {
+    // Precompiled (ready to run) code is never jitted, this is the only time we hear about it
+    if (result == COR_PRF_CACHED_FUNCTION_FOUND)
+    {
+        sampler->FunctionCompiled(functionId, 0);
+    }
+
     return S_OK;
 }
 
@@ -496,6 +529,11 @@ HRESULT STDMETHODCALLTYPE CorProfiler::GetReJITParameters(ModuleID moduleId, mdM
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ReJITCompilationFinished(FunctionID functionId, ReJITID rejitId, HRESULT hrStatus, BOOL fIsSafeToBlock)
 {
+    if (SUCCEEDED(hrStatus))
+    {
+        sampler->FunctionCompiled(functionId, rejitId);
+    }
+
     return S_OK;
 }
 
@@ -546,11 +584,10 @@ bool CorProfiler::IsRuntimeExecutingManagedCode()
 
 IMetaDataImport *CorProfiler::GetMetadataForModule(ModuleID moduleID)
 {
-    auto metadata = m_moduleMetadata.find(moduleID);
-    if (metadata != m_moduleMetadata.end())
-    {
-        return metadata->second;
-    }
+    return m_moduleMetadata.Find(moduleID);
+}
 
-    return NULL;
+void CorProfiler::ReclaimModuleMetadata()
+{
+    m_moduleMetadata.Reclaim();
 }
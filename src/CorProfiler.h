@@ -13,6 +13,7 @@
 #include "cor.h"
 #include "corprof.h"
 #include "sampler.h"
+#include "module_metadata_table.h"
 
 class CorProfiler : public ICorProfilerCallback8
 {
@@ -22,7 +23,7 @@ private:
 
     std::atomic<int> jitEventCount;
 
-    ThreadSafeMap<ModuleID, IMetaDataImport *> m_moduleMetadata;
+    ModuleMetadataTable m_moduleMetadata;
 
 public:
     ICorProfilerInfo10* corProfilerInfo;
@@ -161,5 +162,8 @@ public:
     }
 
     bool IsRuntimeExecutingManagedCode();
+    // The result stays valid until the next ReclaimModuleMetadata, the sampling thread calls
+    // that between ticks
     IMetaDataImport *GetMetadataForModule(ModuleID moduleID);
+    void ReclaimModuleMetadata();
 };
@@ -3,226 +3,1005 @@
 // See the LICENSE file in the project root for more information.
 
 #include <signal.h>
+#include <sys/ucontext.h>
 #include <cinttypes>
-#include <locale>
-#include <codecvt>
+#include <cstring>
 
-#define UNW_LOCAL_ONLY
-#include <libunwind.h>
-
-#include <dlfcn.h>
 #include <execinfo.h>
 #include <fstream>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
 
 #include "CorProfiler.h"
 #include "async_sampler.h"
 
-using std::wstring_convert;
-using std::codecvt_utf8;
 using std::string;
 using std::ifstream;
 
-AutoEvent AsyncSampler::s_threadSampledEvent;
+// A thread we just signalled uses a little CPU after the handler has finished, see
+// TryReuseIdleSample. Measured at around 10us, this leaves room for slower machines.
+static constexpr uint64_t SignalReturnAllowanceNs = 50 * 1000;
+
+SignalSafeEvent AsyncSampler::s_threadSampledEvent;
 AsyncSampler *AsyncSampler::s_instance;
 
+// The signal handler runs on the thread being sampled, so the slot is found through a thread
+// local that ThreadCreated fills in. initial-exec keeps the access a plain load off the thread
+// pointer instead of a call in to __tls_get_addr, which is not signal safe.
+#ifdef __linux__
+static thread_local StackCaptureSlot *t_captureSlot __attribute__((tls_model("initial-exec"))) = nullptr;
+#else // __linux__
+static thread_local StackCaptureSlot *t_captureSlot = nullptr;
+#endif // __linux__
+
 //static
-void AsyncSampler::SignalHandler(int signal, siginfo_t *info, void *unused)
+void AsyncSampler::SignalHandler(int signal, siginfo_t *info, void *context)
 {
-    // What is this signal handler doing? It is copying the entire stack off for later processing.
+    // What is this signal handler doing? It is copying the entire stack off for later processing
+    // (or with frame pointer capture, just the return addresses).
     // The stack base is precalculated and stored at thread creation time, since the functions
-    // for querying the stack base are not signal safe. This signal handler is not reentrancy safe,
-    // pains have been taken to synchronize with the sampling thread so it should never be called
-    // in a reentrant manner.
+    // for querying the stack base are not signal safe. Each thread copies in to its own slot,
+    // and a thread can't re-enter its own handler since SIGUSR2 is masked while it runs.
 
-    unw_context_t context;
-    unw_getcontext(&context);
-
-    unw_cursor_t cursor;
-    unw_init_local(&cursor, &context);
+    StackCaptureSlot *slot = t_captureSlot;
+    if (slot == nullptr || !pthread_equal(slot->owner.load(std::memory_order_acquire), pthread_self()))
+    {
+        return;
+    }
 
-    // Get current stack pointer for the top bound of what to copy
-    unw_word_t sp;
-    unw_get_reg(&cursor, UNW_REG_SP, &sp);
+    // clock_gettime is async signal safe
+    uint64_t handlerStart = GetTimestamp();
 
-    // This may cause confusion, since as developers we talk about the top of the stack being
-    // the stack associated with the leaf functions, but since the stack grows downwards the
-    // top is actually the lowest address and the bottom is the highest.
-    uintptr_t stackTop = (uintptr_t)sp;
-    uintptr_t stackBottom = (uintptr_t)AsyncSampler::Instance()->m_stackBase;
+    uint64_t sequence;
+    if (info != nullptr && info->si_code == SI_TIMER)
+    {
+        // Our CPU timer fired. si_overrun counts expirations that were merged in to this
+        // signal, they all get charged to the next capture.
+        slot->timerExpirations = slot->timerExpirations + 1 + (uint32_t)info->si_overrun;
 
-    // Get current RBP as the value to start the stack walking from. If setting up libunwind
-    // proves to be too slow it would be fairly trivial to write an assembly stub that captures it.
-    unw_word_t rbp;
-    unw_get_reg(&cursor, UNW_X86_64_RBP, &rbp);
+        uint64_t completed = slot->completedSequence.load(std::memory_order_relaxed);
+        if (completed != slot->collectedSequence.load(std::memory_order_acquire))
+        {
+            // The last capture hasn't been walked yet, don't overwrite it
+            return;
+        }
 
-    AsyncSampler::Instance()->m_firstRBP = (uintptr_t)rbp;
-    uintptr_t stackSize = stackBottom - stackTop;
+        sequence = completed + 1;
+        slot->requestedSequence.store(sequence, std::memory_order_relaxed);
+        slot->captureWeight = slot->timerExpirations;
+        slot->timerExpirations = 0;
+    }
+    else
+    {
+        sequence = slot->requestedSequence.load(std::memory_order_acquire);
+        if (sequence == slot->completedSequence.load(std::memory_order_relaxed))
+        {
+            // Nothing was asked of us, this is a stale or duplicate signal
+            return;
+        }
+    }
 
-    // Copy the stack off, limiting to the top 32kb if larger than that
-    uintptr_t startIndex = 0;
-    if (stackSize >= AsyncSampler::Instance()->m_stack.size())
+    // The kernel saved the interrupted registers in the ucontext before calling us, so there's
+    // no need to capture (or unwind from) the handler's own. That also means the walk starts at
+    // the frame that was actually running rather than at the signal trampoline above it.
+    uintptr_t ip;
+    uintptr_t sp;
+    uintptr_t framePointer;
+    if (!GetInterruptedRegisters(context, &ip, &sp, &framePointer))
     {
-        printf("here! stackSize=%" PRIu64 " array size=%zu\n", stackSize, AsyncSampler::Instance()->m_stack.size());
-        // Copy the top 32k since that's all we have room for
-        memcpy((void *)AsyncSampler::Instance()->m_stack.data(), (void *)stackTop, AsyncSampler::Instance()->m_stack.size());
+        ip = 0;
+        sp = 0;
+        framePointer = 0;
+    }
 
-        // This is a little bit of a hack, but makes stack relocation later easier
-        // TODO: should actually test this to make sure it works as expected.
-        uintptr_t stackDiff = stackSize - AsyncSampler::Instance()->m_stack.size();
-        AsyncSampler::Instance()->m_stackBase = stackBottom - stackDiff;
+    slot->interruptedIP = ip;
+    if (s_instance->m_framePointerCapture)
+    {
+        CaptureFramePointers(slot, sp, framePointer);
     }
     else
     {
-        // Only will partially fill the array
-        startIndex = AsyncSampler::Instance()->m_stack.size() - stackSize;
-        memcpy((void *)(&AsyncSampler::Instance()->m_stack[startIndex]), (void *)stackTop, stackSize);
+        CaptureStack(slot, sp, framePointer);
     }
 
-    AsyncSampler::Instance()->m_startIndex = startIndex;
+    slot->handlerNs = GetTimestamp() - handlerStart;
+
+    struct timespec cpuTime;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTime);
+    slot->handlerEndCpuNs = (uint64_t)cpuTime.tv_sec * 1000000000 + (uint64_t)cpuTime.tv_nsec;
+
+    slot->completedSequence.store(sequence, std::memory_order_release);
 
-    // TODO: mutex use is not signal safe
     s_threadSampledEvent.Signal();
 }
 
+//static
+bool AsyncSampler::GetInterruptedRegisters(void *context, uintptr_t *ip, uintptr_t *sp, uintptr_t *framePointer)
+{
+    if (context == nullptr)
+    {
+        return false;
+    }
+
+    // Only AMD64 for now, like the rest of the stack walking
+#if defined(__linux__) && defined(__x86_64__)
+    const mcontext_t &registers = ((const ucontext_t *)context)->uc_mcontext;
+    *ip = (uintptr_t)registers.gregs[REG_RIP];
+    *sp = (uintptr_t)registers.gregs[REG_RSP];
+    *framePointer = (uintptr_t)registers.gregs[REG_RBP];
+    return true;
+#elif defined(__APPLE__) && defined(__x86_64__)
+    const mcontext_t registers = ((const ucontext_t *)context)->uc_mcontext;
+    *ip = (uintptr_t)registers->__ss.__rip;
+    *sp = (uintptr_t)registers->__ss.__rsp;
+    *framePointer = (uintptr_t)registers->__ss.__rbp;
+    return true;
+#else
+    return false;
+#endif
+}
+
+//static
+void AsyncSampler::CaptureStack(StackCaptureSlot *slot, uintptr_t sp, uintptr_t framePointer)
+{
+    // This may cause confusion, since as developers we talk about the top of the stack being
+    // the stack associated with the leaf functions, but since the stack grows downwards the
+    // top is actually the lowest address and the bottom is the highest.
+    uintptr_t stackTop = sp;
+    uintptr_t stackBottom = slot->threadStackBase;
+
+    // Copy the stack off, limiting to the top 32kb if larger than that. sp and the stack
+    // base are both word aligned, so this is a straight word copy in to the end of the
+    // buffer and stackBase is moved down to just past the last word copied. An sp outside the
+    // thread's stack (e.g. the runtime's SIGSEGV handler running on an alternate signal stack)
+    // copies nothing, the memory between it and the stack base needn't be mapped.
+    bool onThreadStack = stackTop != 0 && stackTop >= slot->threadStackLimit && stackTop < stackBottom;
+    uintptr_t stackWords = onThreadStack ? (stackBottom - stackTop) / sizeof(uintptr_t) : 0;
+    uint32_t copyWords = (uint32_t)std::min<uintptr_t>(stackWords, StackCaptureWords);
+    uint32_t startIndex = StackCaptureWords - copyWords;
+    memcpy(&slot->stack[startIndex], (const void *)stackTop, copyWords * sizeof(uintptr_t));
+
+    slot->firstSP = sp;
+    slot->firstRBP = framePointer;
+    slot->stackBase = stackTop + copyWords * sizeof(uintptr_t);
+    slot->startIndex = startIndex;
+}
+
+//static
+void AsyncSampler::CaptureFramePointers(StackCaptureSlot *slot, uintptr_t sp, uintptr_t framePointer)
+{
+    // Same walk as WalkCapturedStack does over the copy, but reading the live stack. Every
+    // address is checked against the thread's stack before it's dereferenced: nothing the
+    // interrupted code owns is below its SP and the highest is the stack base recorded at
+    // ThreadCreated. Frames have to move strictly towards the base, so a corrupt chain can't loop.
+    // If sp isn't inside the stack recorded at ThreadCreated the thread is on some other stack
+    // (an alternate signal stack) and nothing is read.
+    uintptr_t stackLow = sp;
+    uintptr_t stackHigh = slot->threadStackBase;
+    if (stackLow == 0 || stackLow < slot->threadStackLimit || stackHigh <= stackLow + 2 * sizeof(uintptr_t))
+    {
+        slot->frameCount = 0;
+        return;
+    }
+
+    uint32_t frameCount = 0;
+    uintptr_t rbp = framePointer;
+    while (frameCount < MaxCapturedFrames)
+    {
+        if (rbp < stackLow || rbp > stackHigh - 2 * sizeof(uintptr_t) || (rbp & (sizeof(uintptr_t) - 1)) != 0)
+        {
+            break;
+        }
+
+        const uintptr_t *frame = (const uintptr_t *)rbp;
+        slot->returnAddresses[frameCount++] = frame[1];
+
+        uintptr_t next = frame[0];
+        if (next <= rbp)
+        {
+            break;
+        }
+
+        rbp = next;
+    }
+
+    slot->frameCount = frameCount;
+}
+
 bool AsyncSampler::BeforeSampleAllThreads()
 {
+    RecycleRetiredSlots();
+    m_codeRanges.Update();
     return true;
 }
 
 bool AsyncSampler::AfterSampleAllThreads()
 {
+    CollectPendingCaptures();
     return true;
 }
 
-uintptr_t AsyncSampler::MapStackAddressToLocalOffset(uintptr_t address)
+StackCaptureSlot *AsyncSampler::GetCaptureSlot(ThreadID threadID)
 {
-    // All of the RBPs reference the stack, so when we copied it the stack all of the
-    // addresses are still pointing at the old stack. This function does a basic fixup
-    // by mapping the old stack value to an index in to the m_stack array.
+    StackCaptureSlot *slot;
+    if (!m_slotMap.Find(threadID, &slot))
+    {
+        return nullptr;
+    }
+
+    return slot;
+}
+
+void AsyncSampler::RecycleRetiredSlots()
+{
+    std::lock_guard<std::mutex> lock(m_slotLock);
+    m_freeSlots.insert(m_freeSlots.end(), m_retiredSlots.begin(), m_retiredSlots.end());
+    m_retiredSlots.clear();
+    m_slotMap.Reclaim();
+}
+
+void AsyncSampler::CollectPendingCaptures()
+{
+    // Walk each slot as soon as its handler publishes it, so the total time is bounded by the
+    // slowest thread to respond rather than the sum of all of them.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_captureTimeoutMs);
+    while (!m_pendingSlots.empty())
+    {
+        bool collectedAny = false;
+        for (size_t i = 0; i < m_pendingSlots.size(); )
+        {
+            StackCaptureSlot *slot = m_pendingSlots[i].first;
+            uint64_t sequence = m_pendingSlots[i].second;
+            if (slot->completedSequence.load(std::memory_order_acquire) != sequence)
+            {
+                ++i;
+                continue;
+            }
+
+            ProcessCapture(slot, m_tickWeight, 0, false);
+
+            m_pendingSlots[i] = m_pendingSlots.back();
+            m_pendingSlots.pop_back();
+            collectedAny = true;
+        }
+
+        if (collectedAny || m_pendingSlots.empty())
+        {
+            continue;
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0 || !s_threadSampledEvent.WaitFor((int)remaining.count()))
+        {
+            // Abandon the stragglers. If a handler does run later it sees the next request's
+            // sequence number (or none), so it can never publish in to a collection we aren't
+            // waiting for.
+            for (auto &pending : m_pendingSlots)
+            {
+                fprintf(m_outputFile, "Timed out waiting for managed thread id=0x%" PRIx64 " to capture its stack\n", (uint64_t)pending.first->threadID);
+            }
 
-    uintptr_t offsetFromStackBase = m_stackBase - address;
-    return m_stack.size() - offsetFromStackBase;
+            m_captureTimeouts += m_pendingSlots.size();
+            m_pendingSlots.clear();
+            fprintf(m_outputFile, "Total capture timeouts=%" PRIu64 "\n", m_captureTimeouts);
+        }
+    }
 }
 
-uintptr_t AsyncSampler::ReadPtrSlotFromStack(uintptr_t offset)
+//static
+bool AsyncSampler::ReadStackWord(const StackCaptureSlot *slot, uintptr_t address, uintptr_t *value)
 {
-    // This makes so many assumptions. Endian-ness, 64 bit architecture, etc.
-    Int64Parser parser;
-    parser.eighth   = m_stack[offset + 7];
-    parser.seventh  = m_stack[offset + 6];
-    parser.sixth    = m_stack[offset + 5];
-    parser.fifth    = m_stack[offset + 4];
-    parser.fourth   = m_stack[offset + 3];
-    parser.third    = m_stack[offset + 2];
-    parser.second   = m_stack[offset + 1];
-    parser.first    = m_stack[offset];
+    uint32_t index = GetStackWordIndex(slot, address);
+    if (index >= StackCaptureWords)
+    {
+        return false;
+    }
 
-    return parser.i;
+    *value = slot->stack[index];
+    return true;
+}
+
+bool AsyncSampler::UnwindCopiedFrame(const StackCaptureSlot *slot, bool leaf, uintptr_t *ip, uintptr_t *sp, uintptr_t *rbp)
+{
+    // A return address points after the call, which can be the first byte of the next function
+    // when the call doesn't return, so callers are looked up one byte earlier. The leaf frame
+    // was interrupted at ip itself.
+    uintptr_t lookupIP = leaf ? *ip : *ip - 1;
+
+    uintptr_t cfa;
+    uintptr_t returnAddress;
+    uintptr_t callerRbp = *rbp;
+    UnwindRule rule;
+    if (m_nativeSymbolizer.FindUnwindRule(lookupIP, &rule))
+    {
+        // Native code with .eh_frame. The CFA is the caller's SP, the return address and (if
+        // this function saved it) the caller's RBP are stored just below it.
+        cfa = (rule.cfaRegister == CfaRegister::Rbp ? *rbp : *sp) + rule.cfaOffset;
+        if (!ReadStackWord(slot, cfa + rule.returnAddressOffset, &returnAddress)
+            || (rule.rbpOffset != 0 && !ReadStackWord(slot, cfa + rule.rbpOffset, &callerRbp)))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // Managed code, or native code we have no unwind info for. This sampler only works for
+        // AMD64 currently, here it walks the RBP chain. RBP points to a stack slot that has the
+        // previous functions RBP in it, the word after it contains the IP to return to.
+        //
+        // The algorithm is:
+        //      rbp = *rbp
+        //      ip = *(rbp + 1)
+        cfa = *rbp + 2 * sizeof(uintptr_t);
+        if (!ReadStackWord(slot, *rbp + sizeof(uintptr_t), &returnAddress)
+            || !ReadStackWord(slot, *rbp, &callerRbp))
+        {
+            return false;
+        }
+    }
+
+    // Each frame has to be further up the stack than the last, so a corrupt chain can't loop
+    if (cfa <= *sp)
+    {
+        return false;
+    }
+
+    *ip = returnAddress;
+    *sp = cfa;
+    *rbp = callerRbp;
+    return true;
+}
+
+//static
+uint32_t AsyncSampler::GetStackWordIndex(const StackCaptureSlot *slot, uintptr_t address)
+{
+    // All of the RBPs reference the stack, so when we copied it the stack all of the
+    // addresses are still pointing at the old stack. This maps an address on the old stack
+    // to the index of the same word in the slot's copy.
+    uintptr_t offsetFromStackBase = slot->stackBase - address;
+    if (address >= slot->stackBase
+        || offsetFromStackBase > StackCaptureWords * sizeof(uintptr_t)
+        || (address & (sizeof(uintptr_t) - 1)) != 0)
+    {
+        return StackCaptureWords;
+    }
+
+    uint32_t index = StackCaptureWords - (uint32_t)(offsetFromStackBase / sizeof(uintptr_t));
+    return index >= slot->startIndex ? index : StackCaptureWords;
 }
 
 bool AsyncSampler::SampleThread(ThreadID threadID)
 {
-    // m_stackBase needs to be pre-set so the signal handler can access them without
-    // going through the locks in the ThreadSafeMap class.
-    pthread_t pThreadID = GetPThreadID(threadID);
-    m_stackBase = (uintptr_t)GetStackBase(threadID);
-    if (m_stackBase == 0)
+    StackCaptureSlot *slot = GetCaptureSlot(threadID);
+    if (slot == nullptr || slot->threadStackBase == 0)
     {
         fprintf(m_outputFile, "Don't know stack base for thread, skipping...\n");
         return false;
     }
 
+    if (m_cpuTimers)
+    {
+        CollectTimerCapture(slot);
+        return true;
+    }
+
+    if (m_skipIdleThreads && TryReuseIdleSample(slot))
+    {
+        return true;
+    }
+
+    // Forget the old stack until this capture is walked, if it times out we know nothing
+    slot->lastStackId = StackTrie::InvalidId;
+
+    uint64_t sequence = slot->requestedSequence.load(std::memory_order_relaxed) + 1;
+    slot->requestedSequence.store(sequence, std::memory_order_release);
+
     // Send the signal, currently using SIGUSR2 but before using in production should verify it's safe
     // and nothing else uses it.
-    fprintf(m_outputFile, "Sending signal to thread %p state=%d\n", (void *)pThreadID, GetThreadState(threadID));
-    fflush(m_outputFile);
-    int result = pthread_kill(pThreadID, SIGUSR2);
-    fprintf(m_outputFile, "pthread_kill result=%d\n", result);
+    int result = pthread_kill(slot->pThreadID, SIGUSR2);
+    if (result != 0)
+    {
+        fprintf(m_outputFile, "pthread_kill failed with result=%d\n", result);
+        return false;
+    }
 
-    // Only sample one thread at a time
-    s_threadSampledEvent.Wait();
+    m_pendingSlots.push_back(std::make_pair(slot, sequence));
 
-    fprintf(m_outputFile, "starting manual RBP stack unwind...\n");
+    if (!m_parallelCapture)
+    {
+        // Only sample one thread at a time
+        CollectPendingCaptures();
+    }
 
-    uintptr_t rbp = MapStackAddressToLocalOffset(m_firstRBP);
-    while (true)
+    return true;
+}
+
+void AsyncSampler::CollectTimerCapture(StackCaptureSlot *slot)
+{
+    // A thread that hasn't used an interval of CPU since the last tick has nothing for us
+    uint64_t completed = slot->completedSequence.load(std::memory_order_acquire);
+    if (completed == slot->collectedSequence.load(std::memory_order_relaxed))
     {
-        // This sampler only works for AMD64 currently, and works by walking the RBP chain.
-        // RBP points to a stack slot that has the previous functions RBP in it, RBP+1 (or +8 here
-        // since m_stack is in bytes) contains the IP to return to.
-        //
-        // The algorithm is:
-        //      rbp = *rbp
-        //      ip = *(rbp + 8)
-        //
-        // Then we can map the IP to either managed or native code.
+        return;
+    }
+
+    // Timer intervals are stretched by the same multiplier as the tick. The stack buffer goes
+    // back to the handler once it's been walked.
+    ProcessCapture(slot, slot->captureWeight * m_intervalMultiplier.load(std::memory_order_relaxed), completed, false);
+}
+
+bool AsyncSampler::ReadThreadCpuTime(StackCaptureSlot *slot, uint64_t *cpuNs)
+{
+#ifdef __linux__
+    struct timespec cpuTime;
+    if (!slot->hasCpuClock || clock_gettime(slot->cpuClock, &cpuTime) != 0)
+    {
+        return false;
+    }
+
+    *cpuNs = (uint64_t)cpuTime.tv_sec * 1000000000 + (uint64_t)cpuTime.tv_nsec;
+    return true;
+#else // __linux__
+    ThreadStateInfo info;
+    if (!GetThreadStateInfo(slot->threadID, &info))
+    {
+        return false;
+    }
+
+    *cpuNs = info.userNs + info.systemNs;
+    return true;
+#endif // __linux__
+}
+
+bool AsyncSampler::TryReuseIdleSample(StackCaptureSlot *slot)
+{
+    uint64_t cpuNs;
+    if (slot->lastStackId == StackTrie::InvalidId || !ReadThreadCpuTime(slot, &cpuNs))
+    {
+        return false;
+    }
+
+    // Our own signal costs the thread some CPU after the handler's last reading (returning from
+    // the handler and restarting whatever call it was blocked in), so the first comparison
+    // after a capture allows for that. From then on the baseline is a reading we took while
+    // leaving the thread alone and it has to match exactly.
+    bool idle;
+    if (slot->idleBaselineExact)
+    {
+        idle = cpuNs == slot->idleCpuNs;
+    }
+    else
+    {
+        idle = cpuNs >= slot->idleCpuNs && cpuNs - slot->idleCpuNs <= SignalReturnAllowanceNs;
+    }
+
+    if (!idle)
+    {
+        return false;
+    }
 
-        uintptr_t ipOffset = rbp + 8;
-        uintptr_t ip = ReadPtrSlotFromStack(ipOffset);
-        FunctionID functionID;
-        HRESULT hr = m_pCorProfilerInfo->GetFunctionFromIP((uint8_t *)ip, &functionID);
-        if (hr == S_OK)
+    slot->idleCpuNs = cpuNs;
+    slot->idleBaselineExact = true;
+
+    ProcessCapture(slot, m_tickWeight, 0, true);
+    ++m_idleSamplesReused;
+    return true;
+}
+
+void AsyncSampler::ProcessCapture(StackCaptureSlot *slot, uint32_t weight, uint64_t collectedSequence, bool repeat)
+{
+    if (!repeat)
+    {
+        m_tickHandlerNs += slot->handlerNs;
+        ++m_samplesCaptured;
+    }
+
+    CaptureWork work = { slot, weight, collectedSequence, repeat };
+    if (!m_workers.empty())
+    {
+        m_outstandingWork.fetch_add(1);
+        if (m_workQueue.TryPush(work))
         {
-            // We found managed code, look up the function name to print it out.
-            WSTRING functionName = s_instance->GetFunctionName(functionID, NULL);
+            // A worker that found the queue empty registers as idle before looking one last
+            // time, so either it sees this work or we see it and wake it
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_idleWorkers.load() != 0)
+            {
+                m_workAvailableEvent.Signal();
+            }
+
+            return;
+        }
+
+        // The queue has room for every slot, so this shouldn't happen. Don't lose the sample.
+        m_outstandingWork.fetch_sub(1);
+    }
+
+    ProcessWork(work, &m_rawFrames, &m_frames);
+}
+
+void AsyncSampler::ProcessWork(const CaptureWork &work, std::vector<RawFrame> *frames, std::vector<uint32_t> *frameIds)
+{
+    StackCaptureSlot *slot = work.slot;
+    if (work.repeat)
+    {
+        ProcessRepeatedSample(slot->threadID, slot->lastStackId, work.weight);
+        return;
+    }
+
+    WalkCapturedStack(slot, frames);
+
+    if (work.collectedSequence != 0)
+    {
+        // Hands the stack buffer back to the handler for the next capture
+        slot->collectedSequence.store(work.collectedSequence, std::memory_order_release);
+    }
+
+    if (m_deferSymbols && m_workers.empty())
+    {
+        // Slots aren't recycled until the next tick starts, so it's still this thread's when
+        // the stack ID comes back
+        RecordRawSample(slot->threadID, *frames, work.weight, &slot->lastStackId);
+    }
+    else
+    {
+        slot->lastStackId = ProcessRawSample(slot->threadID, *frames, work.weight, frameIds);
+    }
+
+    slot->idleCpuNs = slot->handlerEndCpuNs;
+    slot->idleBaselineExact = false;
+}
 
-    #if WIN32
-            wstring_convert<codecvt_utf8<wchar_t>, wchar_t> convert;
-    #else // WIN32
-            wstring_convert<codecvt_utf8<char16_t>, char16_t> convert;
-    #endif // WIN32
+void AsyncSampler::WalkCapturedStack(const StackCaptureSlot *slot, std::vector<RawFrame> *frames)
+{
+    frames->clear();
 
-            string printable = convert.to_bytes(functionName);
-            fprintf(m_outputFile, "%s (funcId=0x%" PRIx64 ")\n", printable.c_str(), (uint64_t)functionID);
+    // The function that was running. If it was stopped in its prologue before setting up its
+    // frame, the chain below skips straight from it to its caller's caller.
+    if (slot->interruptedIP != 0)
+    {
+        frames->push_back(ClassifyFrame(slot->interruptedIP));
+    }
 
+    if (m_framePointerCapture)
+    {
+        // The handler already did the walk
+        uint32_t frameCount = std::min<uint32_t>(slot->frameCount, MaxCapturedFrames);
+        for (uint32_t i = 0; i < frameCount; ++i)
+        {
+            frames->push_back(ClassifyFrame(slot->returnAddresses[i]));
         }
-        else
+    }
+    else
+    {
+        // Unwind the copy one frame at a time, see UnwindCopiedFrame. The leaf frame was already
+        // added above, each step adds the caller it found.
+        uintptr_t ip = slot->interruptedIP;
+        uintptr_t sp = slot->firstSP;
+        uintptr_t rbp = slot->firstRBP;
+        for (uint32_t depth = 0; depth < MaxCapturedFrames; ++depth)
         {
-            // If GetFunctionFromIP returned an error, we are assuming it means native code. Here
-            // we are borrowing dladdr to look up symbolic names, but if native code doesn't matter
-            // to your profiler then feel free to omit this and skip to the next frame to save some
-            // perf cost.
-            const char *nativeName = "Unknown";
-            Dl_info info;
-            int result = dladdr((void *)ip, &info);
-            if (result != 0)
+            if (!UnwindCopiedFrame(slot, depth == 0, &ip, &sp, &rbp) || ip == 0)
             {
-                nativeName = info.dli_sname;
+                break;
             }
 
-            uintptr_t offset = ip - (uintptr_t)info.dli_saddr;
-            fprintf(m_outputFile, "Native frame \"%s+0x%" PRIx64 "\" ip=%" PRIx64 "\n", nativeName, offset, ip);
-         }
+            frames->push_back(ClassifyFrame(ip));
+        }
+    }
+}
+
+RawFrame AsyncSampler::ClassifyFrame(uintptr_t ip)
+{
+    FunctionID functionID;
+    bool managed = m_codeRanges.Find(ip, &functionID);
+    if (!managed && !m_nativeSymbolizer.Contains(ip))
+    {
+        // Code jitted since the start of the tick, a dynamic method, or something we were
+        // never told about
+        m_functionFromIPCalls.fetch_add(1, std::memory_order_relaxed);
+        managed = m_pCorProfilerInfo->GetFunctionFromIP((uint8_t *)ip, &functionID) == S_OK;
+    }
 
-        uintptr_t newRbpRaw = ReadPtrSlotFromStack(rbp);
-        rbp = MapStackAddressToLocalOffset(newRbpRaw);
-        if (rbp < m_startIndex || rbp >= m_stack.size())
+    // If the runtime doesn't know about the IP, we are assuming it means native code
+    RawFrame frame;
+    frame.kind = managed ? FrameKind::Managed : FrameKind::Native;
+    frame.function = FunctionKey { managed ? functionID : 0, 0, 0 };
+    frame.ip = ip;
+    return frame;
+}
+
+void AsyncSampler::WaitForProcessing()
+{
+    while (m_outstandingWork.load() != 0)
+    {
+        m_workDoneEvent.WaitFor(10);
+    }
+}
+
+// static
+void AsyncSampler::DoProcessing(AsyncSampler *sampler)
+{
+    // GetFunctionFromIP is called from here
+    sampler->m_pCorProfilerInfo->InitializeCurrentThread();
+
+    std::vector<RawFrame> frames;
+    std::vector<uint32_t> frameIds;
+    CaptureWork work;
+    uint64_t busyCpuStart = GetCurrentThreadCpuTime();
+    while (true)
+    {
+        if (!sampler->m_workQueue.TryPop(&work))
         {
-            fprintf(m_outputFile, "done, rbp=%" PRIx64 "\n", rbp);
-            break;
+            // Charged per busy stretch rather than per sample, reading the thread's CPU clock
+            // is a system call
+            sampler->m_processingCpuNs.fetch_add(GetCurrentThreadCpuTime() - busyCpuStart, std::memory_order_relaxed);
+
+            sampler->m_idleWorkers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool found = sampler->m_workQueue.TryPop(&work);
+            if (!found)
+            {
+                if (sampler->m_stopWorkers.load())
+                {
+                    sampler->m_idleWorkers.fetch_sub(1);
+                    return;
+                }
+
+                sampler->m_workAvailableEvent.WaitFor(100);
+            }
+
+            sampler->m_idleWorkers.fetch_sub(1);
+            busyCpuStart = GetCurrentThreadCpuTime();
+            if (!found)
+            {
+                continue;
+            }
+        }
+
+        sampler->ProcessWork(work, &frames, &frameIds);
+        if (sampler->m_outstandingWork.fetch_sub(1) == 1)
+        {
+            sampler->m_workDoneEvent.Signal();
+        }
+    }
+}
+
+// static
+uint32_t AsyncSampler::ReadWorkerCount()
+{
+    std::string workersSetting = ReadEnvironmentVariable("STACKSAMPLER_WORKERS");
+    if (workersSetting == "")
+    {
+        return 0;
+    }
+
+    uint32_t workers = (uint32_t)std::min<unsigned long>(64, strtoul(workersSetting.c_str(), nullptr, 10));
+    if (workers != 0)
+    {
+        printf("Processing stacks on %u worker threads\n", workers);
+    }
+
+    return workers;
+}
+
+void AsyncSampler::ThreadCreated(ThreadID threadId)
+{
+    Sampler::ThreadCreated(threadId);
+
+    StackCaptureSlot *slot = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_slotLock);
+        if (!m_freeSlots.empty())
+        {
+            slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        }
+        else
+        {
+            slot = new StackCaptureSlot();
+            m_allSlots.push_back(slot);
         }
     }
 
+    // ThreadCreated is called on the new thread itself, so this is the thread the slot belongs to
+    slot->pThreadID = GetCurrentPThreadID();
+    slot->threadID = threadId;
+    slot->threadStackBase = (uintptr_t)GetCurrentThreadStackBase();
+    slot->threadStackLimit = (uintptr_t)GetCurrentThreadStackLimit();
+    slot->timerExpirations = 0;
+    slot->captureWeight = 0;
+    slot->lastStackId = StackTrie::InvalidId;
+    slot->idleCpuNs = 0;
+    slot->idleBaselineExact = false;
+#ifdef __linux__
+    slot->hasCpuClock = pthread_getcpuclockid(slot->pThreadID, &slot->cpuClock) == 0;
+#else // __linux__
+    slot->hasCpuClock = false;
+#endif // __linux__
+    uint64_t sequence = slot->requestedSequence.load(std::memory_order_relaxed);
+    slot->completedSequence.store(sequence, std::memory_order_relaxed);
+    slot->collectedSequence.store(sequence, std::memory_order_release);
+    slot->owner.store(slot->pThreadID, std::memory_order_release);
+
+    t_captureSlot = slot;
+    if (!m_slotMap.Insert(threadId, slot))
+    {
+        // Sampler::ThreadCreated has already complained, put the slot back for the next thread
+        t_captureSlot = nullptr;
+        slot->owner.store(pthread_t(), std::memory_order_release);
+        std::lock_guard<std::mutex> lock(m_slotLock);
+        m_freeSlots.push_back(slot);
+        return;
+    }
+
+    // The timer has to be created on the thread itself, CLOCK_THREAD_CPUTIME_ID is the CPU
+    // clock of whoever calls timer_create
+    if (m_cpuTimers)
+    {
+        std::lock_guard<std::mutex> lock(m_slotLock);
+        if (!StartCpuTimer(slot))
+        {
+            fprintf(m_outputFile, "Unable to start CPU timer for managed thread id=0x%" PRIx64 ", it won't be sampled\n", (uint64_t)threadId);
+        }
+    }
+}
+
+void AsyncSampler::ThreadDestroyed(ThreadID threadId)
+{
+    Sampler::ThreadDestroyed(threadId);
+
+    StackCaptureSlot *slot;
+    if (!m_slotMap.Remove(threadId, &slot))
+    {
+        return;
+    }
+
+    // A signal that was already on its way must not find the slot once it's been recycled. If
+    // this isn't the dying thread its thread local can't be cleared from here, the owner check
+    // in the handler catches that one.
+    slot->owner.store(pthread_t(), std::memory_order_release);
+    if (pthread_equal(slot->pThreadID, GetCurrentPThreadID()))
+    {
+        t_captureSlot = nullptr;
+    }
+
+    // Under the lock so SamplingIntervalChanged never re-arms a deleted timer
+    std::lock_guard<std::mutex> lock(m_slotLock);
+    StopCpuTimer(slot);
+    m_retiredSlots.push_back(slot);
+}
+
+void AsyncSampler::SamplingIntervalChanged(uint64_t intervalNs)
+{
+    if (!m_cpuTimers)
+    {
+        return;
+    }
+
+    // timer_settime works on any thread's timer, so re-arm them all from here. Threads created
+    // from now on pick up the new interval in StartCpuTimer.
+    std::lock_guard<std::mutex> lock(m_slotLock);
+    for (StackCaptureSlot *slot : m_allSlots)
+    {
+        if (slot->hasCpuTimer)
+        {
+            SetCpuTimerInterval(slot, intervalNs);
+        }
+    }
+}
+
+// static
+SampleClock AsyncSampler::ReadSampleClock()
+{
+    if (ReadEnvironmentVariable("STACKSAMPLER_CLOCK") != "cpu")
+    {
+        return SampleClock::Wall;
+    }
+
+#ifdef __linux__
+    printf("Sampling threads by CPU time\n");
+    return SampleClock::Cpu;
+#else // __linux__
+    printf("CPU time sampling needs per thread timers, which are only supported on linux. Sampling by wall time instead.\n");
+    return SampleClock::Wall;
+#endif // __linux__
+}
+
+#ifdef __linux__
+
+// Older glibc headers only have the raw union member
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif // sigev_notify_thread_id
+
+bool AsyncSampler::StartCpuTimer(StackCaptureSlot *slot)
+{
+    // Deliver straight to this thread, a process directed signal could land on any thread
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGUSR2;
+    event.sigev_notify_thread_id = GetCurrentNativeThreadID();
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &slot->cpuTimer) != 0)
+    {
+        return false;
+    }
+
+    uint64_t intervalNs = m_samplingIntervalNs * m_intervalMultiplier.load();
+    if (!SetCpuTimerInterval(slot, intervalNs))
+    {
+        timer_delete(slot->cpuTimer);
+        return false;
+    }
+
+    slot->hasCpuTimer = true;
     return true;
 }
 
+bool AsyncSampler::SetCpuTimerInterval(StackCaptureSlot *slot, uint64_t intervalNs)
+{
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = (time_t)(intervalNs / 1000000000);
+    spec.it_interval.tv_nsec = (long)(intervalNs % 1000000000);
+    spec.it_value = spec.it_interval;
+
+    return timer_settime(slot->cpuTimer, 0, &spec, nullptr) == 0;
+}
+
+void AsyncSampler::StopCpuTimer(StackCaptureSlot *slot)
+{
+    if (slot->hasCpuTimer)
+    {
+        timer_delete(slot->cpuTimer);
+        slot->hasCpuTimer = false;
+    }
+}
+
+#else // __linux__
+
+bool AsyncSampler::StartCpuTimer(StackCaptureSlot *slot)
+{
+    return false;
+}
+
+bool AsyncSampler::SetCpuTimerInterval(StackCaptureSlot *slot, uint64_t intervalNs)
+{
+    return false;
+}
+
+void AsyncSampler::StopCpuTimer(StackCaptureSlot *slot)
+{
+
+}
+
+#endif // __linux__
+
 AsyncSampler::AsyncSampler(ICorProfilerInfo10* pProfInfo, CorProfiler *parent) :
-    Sampler(pProfInfo, parent),
-    m_stack(),
-    m_stackBase(0),
-    m_firstRBP(0),
-    m_startIndex(0)
+    Sampler(pProfInfo, parent, ReadSampleClock()),
+    m_parallelCapture(ReadEnvironmentVariable("STACKSAMPLER_SERIAL_CAPTURE") == ""),
+    m_framePointerCapture(ReadEnvironmentVariable("STACKSAMPLER_CAPTURE") == "framepointer"),
+    m_cpuTimers(m_sampleClock == SampleClock::Cpu),
+    m_skipIdleThreads(ReadEnvironmentVariable("STACKSAMPLER_SAMPLE_IDLE_THREADS") == ""),
+    m_idleSamplesReused(0),
+    m_samplesCaptured(0),
+    m_codeRanges(pProfInfo),
+    m_functionFromIPCalls(0),
+    m_captureTimeoutMs(100),
+    m_captureTimeouts(0),
+    m_previousSignalAction(),
+    m_slotLock(),
+    m_allSlots(),
+    m_freeSlots(),
+    m_retiredSlots(),
+    m_slotMap(MaxThreads),
+    m_pendingSlots(),
+    m_frames(),
+    m_rawFrames(),
+    m_workQueue(MaxThreads),
+    m_workers(),
+    m_stopWorkers(false),
+    m_outstandingWork(0),
+    m_idleWorkers(0),
+    m_workAvailableEvent(),
+    m_workDoneEvent()
 {
     s_instance = this;
 
+    if (m_framePointerCapture)
+    {
+        printf("Walking frame pointers in the signal handler instead of copying stacks\n");
+    }
+
+    string timeout = ReadEnvironmentVariable("STACKSAMPLER_CAPTURE_TIMEOUT_MS");
+    if (timeout != "")
+    {
+        m_captureTimeoutMs = std::max(1, atoi(timeout.c_str()));
+    }
+
+    // SA_RESTART so the signal doesn't make the sampled thread's blocking calls fail with EINTR,
+    // with CPU timers every busy thread gets interrupted regularly
     struct sigaction sampleAction;
     sampleAction.sa_flags = 0;
     sampleAction.sa_sigaction = AsyncSampler::SignalHandler;
-    sampleAction.sa_flags |= SA_SIGINFO;
+    sampleAction.sa_flags |= SA_SIGINFO | SA_RESTART;
     sigemptyset(&sampleAction.sa_mask);
     sigaddset(&sampleAction.sa_mask, SIGUSR2);
 
-    struct sigaction oldAction;
-    int result = sigaction(SIGUSR2, &sampleAction, &oldAction);
+    int result = sigaction(SIGUSR2, &sampleAction, &m_previousSignalAction);
+
+    uint32_t workerCount = ReadWorkerCount();
+    if (workerCount != 0 && m_deferSymbols)
+    {
+        printf("Stacks are already named off the sampling thread by the workers, STACKSAMPLER_DEFER_SYMBOLS has no effect\n");
+    }
+
+    for (uint32_t i = 0; i < workerCount; ++i)
+    {
+        m_workers.push_back(std::thread(DoProcessing, this));
+    }
+}
+
+AsyncSampler::~AsyncSampler()
+{
+    Shutdown();
+
+    if (m_skipIdleThreads)
+    {
+        fprintf(m_outputFile, "Reused the previous stack for %" PRIu64 " idle thread samples, captured %" PRIu64 " stacks\n",
+            m_idleSamplesReused,
+            m_samplesCaptured);
+    }
+
+    fprintf(m_outputFile, "Fell back to GetFunctionFromIP for %" PRIu64 " frames\n", m_functionFromIPCalls.load());
+
+    // Shutdown took the handler down, so no signal can find a slot any more
+    for (StackCaptureSlot *slot : m_allSlots)
+    {
+        delete slot;
+    }
+}
+
+void AsyncSampler::SamplingStopped()
+{
+    // Whatever is still queued gets written before the workers exit
+    m_stopWorkers.store(true);
+    m_workAvailableEvent.Signal();
+    for (std::thread &worker : m_workers)
+    {
+        worker.join();
+    }
+
+    // Nothing asks for captures any more, and with the timers gone and the handler replaced
+    // none can start either
+    {
+        std::lock_guard<std::mutex> lock(m_slotLock);
+        for (StackCaptureSlot *slot : m_allSlots)
+        {
+            StopCpuTimer(slot);
+        }
+    }
+
+    struct sigaction restoreAction = m_previousSignalAction;
+    if ((restoreAction.sa_flags & SA_SIGINFO) == 0 && restoreAction.sa_handler == SIG_DFL)
+    {
+        // SIGUSR2's default action ends the process, a signal that was already on its way
+        // shouldn't
+        restoreAction.sa_handler = SIG_IGN;
+    }
+
+    sigaction(SIGUSR2, &restoreAction, nullptr);
+}
+
+void AsyncSampler::ModuleUnloaded(ModuleID moduleId)
+{
+    Sampler::ModuleUnloaded(moduleId);
+    m_codeRanges.ModuleUnloaded(moduleId);
+}
+
+void AsyncSampler::FunctionCompiled(FunctionID functionId, ReJITID rejitId)
+{
+    m_codeRanges.AddFunction(functionId, rejitId);
 }
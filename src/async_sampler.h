@@ -7,42 +7,203 @@
 
 #include <pthread.h>
 #include <array>
+#include <vector>
+#include <mutex>
+#include <thread>
 #include <signal.h>
+#include <time.h>
 
 #include "sampler.h"
+#include "code_range_table.h"
+#include "work_queue.h"
+
+// Each managed thread owns one of these for its whole lifetime. The sampling thread bumps
+// requestedSequence and signals the thread, the signal handler copies the stack into the
+// slot and publishes completedSequence = requestedSequence. Because every thread writes to
+// its own slot all threads can be signalled at once and collected as they finish.
+//
+// In CPU time mode nobody sends the signal, the thread's own CPU timer does. The handler then
+// makes the request itself, but only once the sampling thread has walked the previous capture
+// and moved collectedSequence up to match, since there is only room for one stack.
+//
+// The handler takes the interrupted PC, SP and frame pointer from the ucontext the kernel
+// passes it, and either copies the top of the stack for the sampling thread to walk, or with
+// frame pointer capture walks the RBP chain itself and only stores the return addresses. Only
+// the copy can be unwound with .eh_frame, so only it gets through native code that was built
+// without frame pointers.
+//
+// Nothing the handler fills in is volatile or atomic. Its plain stores are published by the
+// release store to completedSequence, and the sampling thread only reads them after an acquire
+// load has seen that sequence, so the copy and the walk are ordinary memcpy and word loads.
+static constexpr uint32_t MaxCapturedFrames = 512;
+static constexpr uint32_t StackCaptureWords = 32768 / sizeof(uintptr_t);
+
+struct StackCaptureSlot
+{
+    // Where the thread was when the signal arrived, the leaf frame in both capture modes.
+    // 0 if the registers couldn't be read.
+    uintptr_t interruptedIP;
+
+    // Copy capture. The words just below stackBase, the last one is the word at
+    // stackBase - sizeof(uintptr_t). If the thread's stack was shorter than the buffer only the
+    // words from startIndex on were filled in.
+    alignas(64) std::array<uintptr_t, StackCaptureWords> stack;
+    uintptr_t stackBase;
+    uintptr_t firstSP;
+    uintptr_t firstRBP;
+    uint32_t startIndex;
+
+    // Frame pointer capture only, leaf first
+    std::array<uintptr_t, MaxCapturedFrames> returnAddresses;
+    uint32_t frameCount;
+
+    std::atomic<uint64_t> requestedSequence;
+    std::atomic<uint64_t> completedSequence;
+    std::atomic<uint64_t> collectedSequence;
+
+    // CPU time mode only. Timer expirations (including overruns) that haven't made it in to a
+    // capture yet, and how many the last published capture stands for. Only the handler
+    // writes timerExpirations.
+    uint32_t timerExpirations;
+    uint32_t captureWeight;
+
+    // How long the handler took to make the last capture, and the thread's CPU time as it
+    // finished
+    uint64_t handlerNs;
+    uint64_t handlerEndCpuNs;
+
+    // The last stack walked for this thread and the CPU time it is compared against, see
+    // SampleThread. Written by whoever processes the slot's capture (the sampling thread or a
+    // worker), read by the sampling thread once the workers are done with the tick.
+    // cpuClock is this thread's CPU clock (linux).
+    uint32_t lastStackId;
+    uint64_t idleCpuNs;
+    bool idleBaselineExact;
+    clockid_t cpuClock;
+    bool hasCpuClock;
+    timer_t cpuTimer;
+    bool hasCpuTimer;
+
+    // The thread the slot currently belongs to, cleared by ThreadDestroyed. The handler checks
+    // it since ThreadDestroyed can't clear the thread local of a thread other than its own, and
+    // that thread could take a late signal after the slot has gone to someone else.
+    std::atomic<pthread_t> owner;
+
+    // Written once at ThreadCreated time, read-only after that until the slot is recycled
+    pthread_t pThreadID;
+    ThreadID threadID;
+    uintptr_t threadStackBase;
+    uintptr_t threadStackLimit;
+};
 
 class AsyncSampler : public Sampler
 {
 private:
-    typedef union
-    {
-        struct
-        {
-            unsigned int first    : 8;
-            unsigned int second   : 8;
-            unsigned int third    : 8;
-            unsigned int fourth   : 8;
-            unsigned int fifth    : 8;
-            unsigned int sixth    : 8;
-            unsigned int seventh  : 8;
-            unsigned int eighth   : 8;
-        };
-
-        uint64_t i;
-    } Int64Parser;
-
-    static AutoEvent s_threadSampledEvent;
+    static SignalSafeEvent s_threadSampledEvent;
     static AsyncSampler *s_instance;
 
-    std::array<volatile uint8_t, 32768> m_stack;
-    volatile uintptr_t m_stackBase;
-    volatile uintptr_t m_firstRBP;
-    volatile uintptr_t m_startIndex;
+    bool m_parallelCapture;
+
+    // STACKSAMPLER_CAPTURE=framepointer, walk the RBP chain in the handler instead of copying
+    // the stack out. Much less for the handler to do, but only works if every frame has one.
+    bool m_framePointerCapture;
+
+    // Each thread is signalled by its own CLOCK_THREAD_CPUTIME_ID timer instead of by the
+    // sampling thread, which then only collects whatever was captured since the last tick
+    bool m_cpuTimers;
+
+    // Threads that haven't used any CPU since they were last sampled can't have a different
+    // stack, so the last sample is repeated without signalling or walking them
+    bool m_skipIdleThreads;
+    uint64_t m_idleSamplesReused;
+    uint64_t m_samplesCaptured;
 
-    static void SignalHandler(int signal, siginfo_t *info, void *unused);
+    // Frames are classified as managed from our own table of jitted code first, the runtime is
+    // only asked about IPs that aren't in it or in a native library
+    CodeRangeTable m_codeRanges;
+    std::atomic<uint64_t> m_functionFromIPCalls;
 
-    uintptr_t MapStackAddressToLocalOffset(uintptr_t address);
-    uintptr_t ReadPtrSlotFromStack(uintptr_t offset);
+    // How long a tick waits for handlers before giving up on the threads that haven't answered,
+    // a thread with SIGUSR2 blocked or one that exited after being enumerated never will.
+    int m_captureTimeoutMs;
+    uint64_t m_captureTimeouts;
+
+    // What SIGUSR2 did before the handler was installed, put back by SamplingStopped
+    struct sigaction m_previousSignalAction;
+
+    // Slots are never freed while the profiler is alive, destroyed threads put them on the
+    // retired list and they only become reusable at the start of the next tick so the sampling
+    // thread never sees a slot change owners in the middle of a collection.
+    std::mutex m_slotLock;
+    std::vector<StackCaptureSlot *> m_allSlots;
+    std::vector<StackCaptureSlot *> m_freeSlots;
+    std::vector<StackCaptureSlot *> m_retiredSlots;
+    ThreadRegistry<StackCaptureSlot *> m_slotMap;
+
+    // Only touched by the sampling thread
+    std::vector<std::pair<StackCaptureSlot *, uint64_t>> m_pendingSlots;
+    std::vector<uint32_t> m_frames;
+    std::vector<RawFrame> m_rawFrames;
+
+    // A capture that's ready to be walked and written
+    struct CaptureWork
+    {
+        StackCaptureSlot *slot;
+        uint32_t weight;
+        // CPU time mode, what collectedSequence moves up to once the stack is walked. 0 if
+        // there's nothing to hand back.
+        uint64_t collectedSequence;
+        // Write the slot's last stack again instead of walking it, see TryReuseIdleSample
+        bool repeat;
+    };
+
+    // STACKSAMPLER_WORKERS. The sampling thread only collects captures and queues them, the
+    // workers walk, name and write them. No workers means it's all done on the sampling thread.
+    // Work queued in one tick is always finished before the next one starts (WaitForProcessing),
+    // so everything the tick boundary reclaims is safe from the workers too.
+    WorkQueue<CaptureWork> m_workQueue;
+    std::vector<std::thread> m_workers;
+    std::atomic<bool> m_stopWorkers;
+    std::atomic<uint32_t> m_outstandingWork;
+    std::atomic<uint32_t> m_idleWorkers;
+    SignalSafeEvent m_workAvailableEvent;
+    SignalSafeEvent m_workDoneEvent;
+
+    static void SignalHandler(int signal, siginfo_t *info, void *context);
+    static bool GetInterruptedRegisters(void *context, uintptr_t *ip, uintptr_t *sp, uintptr_t *framePointer);
+    static void CaptureStack(StackCaptureSlot *slot, uintptr_t sp, uintptr_t framePointer);
+    static void CaptureFramePointers(StackCaptureSlot *slot, uintptr_t sp, uintptr_t framePointer);
+    static SampleClock ReadSampleClock();
+    static uint32_t ReadWorkerCount();
+    static void DoProcessing(AsyncSampler *sampler);
+
+    bool StartCpuTimer(StackCaptureSlot *slot);
+    bool SetCpuTimerInterval(StackCaptureSlot *slot, uint64_t intervalNs);
+    void StopCpuTimer(StackCaptureSlot *slot);
+
+    StackCaptureSlot *GetCaptureSlot(ThreadID threadID);
+    void RecycleRetiredSlots();
+    void CollectPendingCaptures();
+    void CollectTimerCapture(StackCaptureSlot *slot);
+    bool ReadThreadCpuTime(StackCaptureSlot *slot, uint64_t *cpuNs);
+    bool TryReuseIdleSample(StackCaptureSlot *slot);
+
+    // Called on the sampling thread once the capture (or the decision to repeat the last one)
+    // is in, processes it right here or queues it for a worker
+    void ProcessCapture(StackCaptureSlot *slot, uint32_t weight, uint64_t collectedSequence, bool repeat);
+    void ProcessWork(const CaptureWork &work, std::vector<RawFrame> *frames, std::vector<uint32_t> *frameIds);
+
+    // Only read state that doesn't change until the next tick, so any number of threads can
+    // walk at once
+    void WalkCapturedStack(const StackCaptureSlot *slot, std::vector<RawFrame> *frames);
+    RawFrame ClassifyFrame(uintptr_t ip);
+
+    // Steps from the frame at ip/sp/rbp to its caller over the copied stack, see WalkCapturedStack
+    bool UnwindCopiedFrame(const StackCaptureSlot *slot, bool leaf, uintptr_t *ip, uintptr_t *sp, uintptr_t *rbp);
+    static bool ReadStackWord(const StackCaptureSlot *slot, uintptr_t address, uintptr_t *value);
+
+    // Index of the word at address in the slot's copy, StackCaptureWords if it wasn't copied
+    static uint32_t GetStackWordIndex(const StackCaptureSlot *slot, uintptr_t address);
 
 protected:
     virtual bool BeforeSampleAllThreads();
@@ -50,6 +211,10 @@ protected:
 
     virtual bool SampleThread(ThreadID threadID);
 
+    virtual void SamplingIntervalChanged(uint64_t intervalNs);
+    virtual void WaitForProcessing();
+    virtual void SamplingStopped();
+
 public:
     static AsyncSampler *Instance()
     {
@@ -57,5 +222,10 @@ public:
     }
 
     AsyncSampler(ICorProfilerInfo10* pProfInfo, CorProfiler *parent);
-    virtual ~AsyncSampler() = default;
+    virtual ~AsyncSampler();
+
+    virtual void ThreadCreated(ThreadID threadId);
+    virtual void ThreadDestroyed(ThreadID threadId);
+    virtual void ModuleUnloaded(ModuleID moduleId);
+    virtual void FunctionCompiled(FunctionID functionId, ReJITID rejitId);
 };
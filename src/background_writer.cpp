@@ -0,0 +1,224 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <cstring>
+#include <cinttypes>
+#include <utility>
+
+#include "background_writer.h"
+
+BackgroundWriter::BackgroundWriter(FILE *outputFile, size_t bufferSize, int flushIntervalMs) :
+    m_outputFile(outputFile),
+    m_capacity(bufferSize),
+    m_highWaterMark(bufferSize / 2),
+    m_flushIntervalMs(flushIntervalMs),
+    m_active(0),
+    m_shutdown(false),
+    m_wakeEvent(),
+    m_ioThread(),
+    m_droppedRecords(0),
+    m_droppedBytes(0),
+    m_bytesWritten(0),
+    m_writeCpuNs(0),
+    m_reportedDrops(0),
+    m_pendingFilesLock(),
+    m_pendingFiles()
+{
+    for (Buffer &buffer : m_buffers)
+    {
+        buffer.data = std::unique_ptr<char[]>(new char[bufferSize]);
+        buffer.used.store(0);
+        buffer.writers.store(0);
+    }
+
+    m_ioThread = std::thread(DoWriting, this);
+}
+
+BackgroundWriter::~BackgroundWriter()
+{
+    Shutdown();
+}
+
+void BackgroundWriter::Shutdown()
+{
+    if (!m_ioThread.joinable())
+    {
+        return;
+    }
+
+    m_shutdown.store(true);
+    m_wakeEvent.Signal();
+    m_ioThread.join();
+
+    if (m_droppedRecords.load() != 0)
+    {
+        printf("Background writer dropped %" PRIu64 " records (%" PRIu64 " bytes) because output couldn't keep up\n",
+            m_droppedRecords.load(),
+            m_droppedBytes.load());
+    }
+}
+
+bool BackgroundWriter::Append(const void *data, size_t size)
+{
+    while (true)
+    {
+        uint32_t index = m_active.load();
+        Buffer &buffer = m_buffers[index];
+
+        // Register as a writer and then make sure the buffer is still the active one. The I/O
+        // thread does the opposite (swap, then wait for writers to drain), and with both
+        // sides sequentially consistent one of them always sees the other.
+        buffer.writers.fetch_add(1);
+        if (m_active.load() != index)
+        {
+            buffer.writers.fetch_sub(1);
+            continue;
+        }
+
+        size_t offset = buffer.used.load();
+        do
+        {
+            if (offset + size > m_capacity)
+            {
+                buffer.writers.fetch_sub(1);
+
+                m_droppedRecords.fetch_add(1, std::memory_order_relaxed);
+                m_droppedBytes.fetch_add(size, std::memory_order_relaxed);
+                m_wakeEvent.Signal();
+                return false;
+            }
+        } while (!buffer.used.compare_exchange_weak(offset, offset + size));
+
+        memcpy(buffer.data.get() + offset, data, size);
+        buffer.writers.fetch_sub(1);
+
+        // Only the record that crosses the mark wakes the writer, the rest stay lock free
+        if (offset < m_highWaterMark && offset + size >= m_highWaterMark)
+        {
+            m_wakeEvent.Signal();
+        }
+
+        return true;
+    }
+}
+
+void BackgroundWriter::WriteFile(std::string fileName, std::string contents, bool replace)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_pendingFilesLock);
+
+        bool superseded = false;
+        if (replace)
+        {
+            for (PendingFile &pending : m_pendingFiles)
+            {
+                if (pending.replace && pending.fileName == fileName)
+                {
+                    pending.contents = std::move(contents);
+                    superseded = true;
+                    break;
+                }
+            }
+        }
+
+        if (!superseded)
+        {
+            m_pendingFiles.push_back(PendingFile { std::move(fileName), std::move(contents), replace });
+        }
+    }
+
+    m_wakeEvent.Signal();
+}
+
+void BackgroundWriter::WritePendingFiles()
+{
+    std::vector<PendingFile> files;
+    {
+        std::lock_guard<std::mutex> lock(m_pendingFilesLock);
+        files.swap(m_pendingFiles);
+    }
+
+    if (files.empty())
+    {
+        return;
+    }
+
+    uint64_t cpuStart = GetCurrentThreadCpuTime();
+    for (const PendingFile &pending : files)
+    {
+        std::string writeName = pending.replace ? pending.fileName + ".tmp" : pending.fileName;
+        FILE *file = fopen(writeName.c_str(), "wb");
+        if (file == nullptr)
+        {
+            printf("Unable to open \"%s\", its contents are lost\n", writeName.c_str());
+            continue;
+        }
+
+        size_t written = fwrite(pending.contents.data(), 1, pending.contents.size(), file);
+        bool failed = fclose(file) != 0 || written != pending.contents.size();
+        if (failed)
+        {
+            printf("Unable to write \"%s\", its contents are lost\n", writeName.c_str());
+            continue;
+        }
+
+        if (pending.replace && rename(writeName.c_str(), pending.fileName.c_str()) != 0)
+        {
+            printf("Unable to replace \"%s\", it wasn't updated\n", pending.fileName.c_str());
+            continue;
+        }
+
+        m_bytesWritten.fetch_add(pending.contents.size(), std::memory_order_relaxed);
+    }
+
+    m_writeCpuNs.fetch_add(GetCurrentThreadCpuTime() - cpuStart, std::memory_order_relaxed);
+}
+
+void BackgroundWriter::SwapAndWrite()
+{
+    uint32_t index = m_active.load();
+    Buffer &buffer = m_buffers[index];
+    if (buffer.used.load() == 0)
+    {
+        return;
+    }
+
+    // The other buffer was emptied the last time through here, so it is safe to hand out
+    m_active.store(1 - index);
+    while (buffer.writers.load() != 0)
+    {
+        std::this_thread::yield();
+    }
+
+    uint64_t cpuStart = GetCurrentThreadCpuTime();
+    size_t size = buffer.used.load();
+    fwrite(buffer.data.get(), 1, size, m_outputFile);
+    fflush(m_outputFile);
+    m_bytesWritten.fetch_add(size, std::memory_order_relaxed);
+    m_writeCpuNs.fetch_add(GetCurrentThreadCpuTime() - cpuStart, std::memory_order_relaxed);
+    buffer.used.store(0);
+
+    uint64_t dropped = m_droppedRecords.load(std::memory_order_relaxed);
+    if (dropped != m_reportedDrops)
+    {
+        printf("Background writer has dropped %" PRIu64 " records so far\n", dropped);
+        m_reportedDrops = dropped;
+    }
+}
+
+// static
+void BackgroundWriter::DoWriting(BackgroundWriter *writer)
+{
+    while (!writer->m_shutdown.load())
+    {
+        writer->m_wakeEvent.WaitFor(writer->m_flushIntervalMs);
+        writer->SwapAndWrite();
+        writer->WritePendingFiles();
+    }
+
+    // Once for each buffer, a record could have landed in the other one during the last swap
+    writer->SwapAndWrite();
+    writer->SwapAndWrite();
+    writer->WritePendingFiles();
+}
@@ -0,0 +1,120 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+// Moves file I/O off the sampling path. Producers copy records in to the active in-memory
+// buffer without taking a lock, a dedicated thread periodically swaps the two buffers and
+// writes the full one out with a single fwrite.
+//
+// When the active buffer passes its high water mark the I/O thread is woken early. If it
+// still can't keep up and the buffer fills, Append drops the whole record and counts it
+// rather than blocking the caller, so a slow disk never stalls sampling.
+//
+// Formats that produce whole files instead of a stream (pprof windows, folded stacks) hand the
+// finished contents to WriteFile and the same thread creates the file.
+class BackgroundWriter
+{
+private:
+    struct PendingFile
+    {
+        std::string fileName;
+        std::string contents;
+        bool replace;
+    };
+
+    struct Buffer
+    {
+        std::unique_ptr<char[]> data;
+        std::atomic<size_t> used;
+        // Producers currently copying in to this buffer
+        std::atomic<uint32_t> writers;
+    };
+
+    FILE *m_outputFile;
+    size_t m_capacity;
+    size_t m_highWaterMark;
+    int m_flushIntervalMs;
+
+    Buffer m_buffers[2];
+    std::atomic<uint32_t> m_active;
+
+    std::atomic<bool> m_shutdown;
+    SignalSafeEvent m_wakeEvent;
+    std::thread m_ioThread;
+
+    std::atomic<uint64_t> m_droppedRecords;
+    std::atomic<uint64_t> m_droppedBytes;
+    std::atomic<uint64_t> m_bytesWritten;
+    std::atomic<uint64_t> m_writeCpuNs;
+    uint64_t m_reportedDrops;
+
+    // Only held to add or take files, never while writing them
+    std::mutex m_pendingFilesLock;
+    std::vector<PendingFile> m_pendingFiles;
+
+    static void DoWriting(BackgroundWriter *writer);
+    void SwapAndWrite();
+    void WritePendingFiles();
+
+public:
+    BackgroundWriter(FILE *outputFile, size_t bufferSize, int flushIntervalMs);
+    ~BackgroundWriter();
+
+    BackgroundWriter(BackgroundWriter& other) = delete;
+    BackgroundWriter(BackgroundWriter&& other) = delete;
+    BackgroundWriter& operator= (BackgroundWriter& other) = delete;
+    BackgroundWriter& operator= (BackgroundWriter&& other) = delete;
+
+    // Lock free, safe to call from any number of threads. Returns false if the record was
+    // dropped because the buffers are full, nothing of it is written in that case.
+    bool Append(const void *data, size_t size);
+
+    // Queues contents to be written to fileName by the I/O thread, which is woken for it. With
+    // replace the file is written next to fileName and renamed over it, so readers never see a
+    // half written file, and a queued write to the same name that hasn't happened yet is
+    // superseded rather than written twice.
+    void WriteFile(std::string fileName, std::string contents, bool replace);
+
+    // Writes out everything buffered and queued and stops the I/O thread. Nothing may be
+    // appended or queued after this, it is called again by the destructor and does nothing then.
+    void Shutdown();
+
+    // Asks the I/O thread to write out whatever is buffered without waiting for the interval
+    void RequestFlush()
+    {
+        m_wakeEvent.Signal();
+    }
+
+    uint64_t DroppedRecords() const
+    {
+        return m_droppedRecords.load(std::memory_order_relaxed);
+    }
+
+    uint64_t DroppedBytes() const
+    {
+        return m_droppedBytes.load(std::memory_order_relaxed);
+    }
+
+    uint64_t BytesWritten() const
+    {
+        return m_bytesWritten.load(std::memory_order_relaxed);
+    }
+
+    // CPU time the I/O thread has spent writing so far
+    uint64_t WriteCpuTime() const
+    {
+        return m_writeCpuNs.load(std::memory_order_relaxed);
+    }
+};
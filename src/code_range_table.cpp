@@ -0,0 +1,145 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <algorithm>
+
+#include "code_range_table.h"
+
+// Most methods are one block, the jit splits out cold code as a second one
+static constexpr ULONG32 InlineCodeInfos = 4;
+
+CodeRangeTable::CodeRangeTable(ICorProfilerInfo10 *pProfInfo) :
+    m_pCorProfilerInfo(pProfInfo),
+    m_pendingLock(),
+    m_pendingRanges(),
+    m_unloadedModules(),
+    m_ranges(),
+    m_updateRanges(),
+    m_updateModules()
+{
+
+}
+
+void CodeRangeTable::AddFunction(FunctionID functionId, ReJITID rejitId)
+{
+    COR_PRF_CODE_INFO codeInfos[InlineCodeInfos];
+    ULONG32 count = 0;
+    HRESULT hr = rejitId == 0
+        ? m_pCorProfilerInfo->GetCodeInfo2(functionId, InlineCodeInfos, &count, codeInfos)
+        : m_pCorProfilerInfo->GetCodeInfo3(functionId, rejitId, InlineCodeInfos, &count, codeInfos);
+    if (FAILED(hr) || count == 0)
+    {
+        return;
+    }
+
+    if (count <= InlineCodeInfos)
+    {
+        AddRanges(functionId, codeInfos, count);
+        return;
+    }
+
+    std::vector<COR_PRF_CODE_INFO> allCodeInfos(count);
+    hr = rejitId == 0
+        ? m_pCorProfilerInfo->GetCodeInfo2(functionId, count, &count, allCodeInfos.data())
+        : m_pCorProfilerInfo->GetCodeInfo3(functionId, rejitId, count, &count, allCodeInfos.data());
+    if (SUCCEEDED(hr))
+    {
+        AddRanges(functionId, allCodeInfos.data(), std::min<ULONG32>(count, (ULONG32)allCodeInfos.size()));
+    }
+}
+
+void CodeRangeTable::AddRanges(FunctionID functionId, const COR_PRF_CODE_INFO *codeInfos, ULONG32 count)
+{
+    // The module is only needed to throw the ranges away again on unload
+    ClassID classId;
+    ModuleID moduleId = 0;
+    mdToken token;
+    m_pCorProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &token);
+
+    std::lock_guard<std::mutex> lock(m_pendingLock);
+    for (ULONG32 i = 0; i < count; ++i)
+    {
+        if (codeInfos[i].size == 0)
+        {
+            continue;
+        }
+
+        CodeRange range;
+        range.start = (uintptr_t)codeInfos[i].startAddress;
+        range.end = range.start + (uintptr_t)codeInfos[i].size;
+        range.functionId = functionId;
+        range.moduleId = moduleId;
+        m_pendingRanges.push_back(range);
+    }
+}
+
+void CodeRangeTable::ModuleUnloaded(ModuleID moduleId)
+{
+    std::lock_guard<std::mutex> lock(m_pendingLock);
+    m_unloadedModules.push_back(moduleId);
+}
+
+void CodeRangeTable::Update()
+{
+    {
+        // Swapping with the spare vectors hands their capacity back, so after warm up this
+        // doesn't allocate
+        std::lock_guard<std::mutex> lock(m_pendingLock);
+        m_updateRanges.swap(m_pendingRanges);
+        m_updateModules.swap(m_unloadedModules);
+    }
+
+    if (!m_updateModules.empty())
+    {
+        // Unloads are rare, a linear pass is fine. Ranges still pending from the unloading
+        // module go too, its code (and FunctionIDs) can be reused for something else.
+        auto unloaded = [this](const CodeRange &range)
+        {
+            return std::find(m_updateModules.begin(), m_updateModules.end(), range.moduleId) != m_updateModules.end();
+        };
+        m_ranges.erase(std::remove_if(m_ranges.begin(), m_ranges.end(), unloaded), m_ranges.end());
+        m_updateRanges.erase(std::remove_if(m_updateRanges.begin(), m_updateRanges.end(), unloaded), m_updateRanges.end());
+        m_updateModules.clear();
+    }
+
+    if (m_updateRanges.empty())
+    {
+        return;
+    }
+
+    auto byStart = [](const CodeRange &left, const CodeRange &right) { return left.start < right.start; };
+    std::sort(m_updateRanges.begin(), m_updateRanges.end(), byStart);
+
+    size_t oldSize = m_ranges.size();
+    m_ranges.insert(m_ranges.end(), m_updateRanges.begin(), m_updateRanges.end());
+    std::inplace_merge(m_ranges.begin(), m_ranges.begin() + oldSize, m_ranges.end(), byStart);
+    m_updateRanges.clear();
+
+    // The same code can be reported twice, e.g. a ReJIT that gets the original code back
+    m_ranges.erase(std::unique(m_ranges.begin(), m_ranges.end(),
+        [](const CodeRange &left, const CodeRange &right)
+        {
+            return left.start == right.start && left.end == right.end && left.functionId == right.functionId;
+        }),
+        m_ranges.end());
+}
+
+bool CodeRangeTable::Find(uintptr_t ip, FunctionID *functionId) const
+{
+    auto it = std::upper_bound(m_ranges.begin(), m_ranges.end(), ip,
+        [](uintptr_t address, const CodeRange &range) { return address < range.start; });
+    if (it == m_ranges.begin())
+    {
+        return false;
+    }
+
+    --it;
+    if (ip >= it->end)
+    {
+        return false;
+    }
+
+    *functionId = it->functionId;
+    return true;
+}
@@ -0,0 +1,65 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "cor.h"
+#include "corprof.h"
+
+// Our own copy of where managed code lives, so classifying a frame's IP is a binary search
+// over a flat array instead of a GetFunctionFromIP call in to the runtime's code manager.
+//
+// Code is added from the runtime's callbacks as it's jitted (or found precompiled), and those
+// come in on any thread. They only append to a pending list under a lock. The sorted array
+// belongs to the sampling thread, which merges the pending ranges in (and drops the ranges
+// of unloaded modules) at the start of each tick with Update.
+//
+// The table is allowed to be incomplete, anything that isn't in it still has to go through
+// GetFunctionFromIP. Dynamic methods are left out on purpose: they can be collected without any
+// callback, and a stale range would put the wrong name on whatever reuses the memory.
+class CodeRangeTable
+{
+private:
+    struct CodeRange
+    {
+        uintptr_t start;
+        uintptr_t end;
+        FunctionID functionId;
+        ModuleID moduleId;
+    };
+
+    ICorProfilerInfo10 *m_pCorProfilerInfo;
+
+    std::mutex m_pendingLock;
+    std::vector<CodeRange> m_pendingRanges;
+    std::vector<ModuleID> m_unloadedModules;
+
+    // Sorted by start, only touched by the sampling thread
+    std::vector<CodeRange> m_ranges;
+    std::vector<CodeRange> m_updateRanges;
+    std::vector<ModuleID> m_updateModules;
+
+    void AddRanges(FunctionID functionId, const COR_PRF_CODE_INFO *codeInfos, ULONG32 count);
+
+public:
+    CodeRangeTable(ICorProfilerInfo10 *pProfInfo);
+    ~CodeRangeTable() = default;
+
+    CodeRangeTable(CodeRangeTable& other) = delete;
+    CodeRangeTable(CodeRangeTable&& other) = delete;
+    CodeRangeTable& operator= (CodeRangeTable& other) = delete;
+    CodeRangeTable& operator= (CodeRangeTable&& other) = delete;
+
+    // Any thread. rejitId is 0 for the original code.
+    void AddFunction(FunctionID functionId, ReJITID rejitId);
+    void ModuleUnloaded(ModuleID moduleId);
+
+    // Sampling thread only
+    void Update();
+    bool Find(uintptr_t ip, FunctionID *functionId) const;
+};
@@ -1,3 +1,6 @@
+#include <chrono>
+#include <time.h>
+
 #include "common.h"
 
 using std::string;
@@ -12,3 +15,20 @@ string ReadEnvironmentVariable(string name)
 
     return string(env);
 }
+
+uint64_t GetTimestamp()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+uint64_t GetCurrentThreadCpuTime()
+{
+    struct timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+    {
+        return 0;
+    }
+
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
@@ -5,12 +5,18 @@
 #pragma once
 
 #include <mutex>
-#include <shared_mutex>
 #include <functional>
 #include <condition_variable>
 #include <string>
 #include <set>
-#include <map>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif // __linux__
 
 #if WIN32
 #define WSTRING std::wstring
@@ -26,6 +32,12 @@
 
 std::string ReadEnvironmentVariable(std::string name);
 
+// Monotonic time in nanoseconds, used to timestamp samples
+uint64_t GetTimestamp();
+
+// CPU time the calling thread has used, in nanoseconds
+uint64_t GetCurrentThreadCpuTime();
+
 template <class MetaInterface>
 class COMPtrHolder
 {
@@ -164,6 +176,7 @@ public:
     {
         std::unique_lock<std::mutex> lock(m_mtx);
         m_set = true;
+        m_cv.notify_all();
     }
 
     void Reset()
@@ -173,37 +186,104 @@ public:
     }
 };
 
-
-template<class Key, class Value>
-class ThreadSafeMap
+// AutoEvent style wakeup that can be signalled from inside a signal handler. Signal() is a
+// single write() to an eventfd (or a pipe where eventfd doesn't exist), both of which are on the
+// async-signal-safe list, where AutoEvent::Signal takes a mutex and a condition variable.
+// Multiple signals before a wait coalesce in to one wakeup, so waiters have to recheck
+// whatever condition they are waiting for.
+class SignalSafeEvent
 {
-  private:
-     std::map<Key, Value> _map;
-     mutable std::shared_mutex _mutex;
+private:
+    int m_readFd;
+    int m_writeFd;
 
-  public:
-    typename std::map<Key, Value>::const_iterator find(Key key) const
+public:
+    SignalSafeEvent()
     {
-        std::shared_lock lock(_mutex);
-        return _map.find(key);
+#ifdef __linux__
+        m_readFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_writeFd = m_readFd;
+#else // __linux__
+        int fds[2] = { -1, -1 };
+        if (pipe(fds) == 0)
+        {
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);
+            fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        }
+
+        m_readFd = fds[0];
+        m_writeFd = fds[1];
+#endif // __linux__
+    }
+
+    ~SignalSafeEvent()
+    {
+        close(m_readFd);
+        if (m_writeFd != m_readFd)
+        {
+            close(m_writeFd);
+        }
     }
 
-    typename std::map<Key, Value>::const_iterator end() const
+    SignalSafeEvent(SignalSafeEvent& other) = delete;
+    SignalSafeEvent(SignalSafeEvent&& other) = delete;
+    SignalSafeEvent& operator= (SignalSafeEvent& other) = delete;
+    SignalSafeEvent& operator= (SignalSafeEvent&& other) = delete;
+
+    // Safe to call from a signal handler
+    void Signal()
     {
-        return _map.end();
+        int savedErrno = errno;
+#ifdef __linux__
+        uint64_t value = 1;
+        ssize_t written = write(m_writeFd, &value, sizeof(value));
+#else // __linux__
+        // If the pipe is full there is already a wakeup pending, so a failed write is fine
+        char value = 0;
+        ssize_t written = write(m_writeFd, &value, sizeof(value));
+#endif // __linux__
+        (void)written;
+        errno = savedErrno;
     }
 
-    // Returns true if new value was inserted
-    bool insertNew(Key key, Value value)
+    // Returns false if the timeout expired without the event being signalled
+    bool WaitFor(int milliseconds)
     {
-        std::unique_lock lock(_mutex);
+        struct pollfd pfd;
+        pfd.fd = m_readFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
 
-        if (_map.find(key) != _map.end())
+        // Any signal landing on this thread interrupts the poll, that isn't a timeout so wait
+        // again for whatever is left
+        uint64_t deadline = GetTimestamp() + (uint64_t)milliseconds * 1000000;
+        int result;
+        while ((result = poll(&pfd, 1, milliseconds)) < 0 && errno == EINTR)
+        {
+            uint64_t now = GetTimestamp();
+            if (now >= deadline)
+            {
+                return false;
+            }
+
+            // Rounded up so a few hundred microseconds left doesn't become a 0 ms poll
+            milliseconds = (int)((deadline - now + 999999) / 1000000);
+        }
+
+        if (result <= 0)
         {
             return false;
         }
 
-        _map[key] = value;
+        // Drain everything so the next wait blocks until a new signal arrives
+        char buffer[64];
+        while (read(m_readFd, buffer, sizeof(buffer)) > 0)
+        {
+
+        }
+
         return true;
     }
 };
@@ -0,0 +1,92 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+// Converts a binary sample file (STACKSAMPLER_OUTPUT=binary) back to the text format the
+// profiler writes by default, so existing scripts can keep consuming it.
+//
+//      convertsamples <input> [output]
+//
+// Writes to stdout if no output file is given.
+
+#include <cstdio>
+#include <cinttypes>
+
+#include "sample_reader.h"
+
+using std::string;
+
+static void WriteTextSample(FILE *output, const SampleReader &reader, const SampleRecord &sample)
+{
+    fprintf(output, "Starting stack walk for managed thread id=0x%" PRIx64 "\n", sample.threadId);
+
+    uint32_t stackId = sample.stackId;
+    while (stackId != StackTrie::RootStackId)
+    {
+        const StackNode &node = reader.GetStack(stackId);
+        const Frame &frame = reader.GetFrame(node.frameId);
+        const string &name = reader.GetString(frame.nameId);
+
+        if (frame.kind == FrameKind::Managed)
+        {
+            fprintf(output, "    %s (funcId=0x%" PRIx64 ")\n", name.c_str(), frame.address);
+        }
+        else
+        {
+            fprintf(output, "    Native frame \"%s+0x%" PRIx64 "\" ip=%" PRIx64 "\n", name.c_str(), frame.offset, frame.address);
+        }
+
+        stackId = node.parent;
+    }
+
+    fprintf(output, "Ending stack walk for managed thread id=0x%" PRIx64 "\n", sample.threadId);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: %s <input> [output]\n", argv[0]);
+        return 1;
+    }
+
+    SampleReader reader;
+    if (!reader.Open(argv[1]))
+    {
+        fprintf(stderr, "Failed to open \"%s\": %s\n", argv[1], reader.GetError().c_str());
+        return 1;
+    }
+
+    FILE *output = stdout;
+    if (argc == 3)
+    {
+        output = fopen(argv[2], "w");
+        if (output == nullptr)
+        {
+            fprintf(stderr, "Unable to open \"%s\" for writing\n", argv[2]);
+            return 1;
+        }
+    }
+
+    uint64_t count = 0;
+    SampleRecord sample;
+    while (reader.ReadSample(&sample))
+    {
+        WriteTextSample(output, reader, sample);
+        ++count;
+    }
+
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+
+    if (!reader.GetError().empty())
+    {
+        fprintf(stderr, "Stopped after %" PRIu64 " samples: %s\n", count, reader.GetError().c_str());
+        return 1;
+    }
+
+    fprintf(stderr, "Converted %" PRIu64 " samples\n", count);
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+// Hands out dense, stable uint32_t IDs for values. Interning an equal value again returns the
+// same ID, IDs are never reused and the reference returned by Get stays valid for the lifetime
+// of the table, so IDs can be handed to output formats that refer back to earlier entries.
+//
+// Values live in fixed size chunks that are never moved, which lets Get skip the lock. Callers
+// have to have gotten the ID from Intern/TryFind (or from something that was published after
+// it), which is what orders the chunk write before the read.
+//
+// The table holds MaxChunks * ChunkSize values. Once that's used up Intern stops adding and
+// returns OverflowId, the first value ever interned, so owners intern a fallback (the empty
+// stack, "Unknown") first and running out degrades to that rather than corrupting memory.
+template <class T, class Hash = std::hash<T>>
+class InternTable
+{
+private:
+    static constexpr uint32_t ChunkBits = 12;
+    static constexpr uint32_t ChunkSize = 1 << ChunkBits;
+    static constexpr uint32_t MaxChunks = 4096;
+
+    struct PointerHash
+    {
+        size_t operator()(const T *value) const
+        {
+            return Hash()(*value);
+        }
+    };
+
+    struct PointerEquals
+    {
+        bool operator()(const T *left, const T *right) const
+        {
+            return *left == *right;
+        }
+    };
+
+    mutable std::shared_mutex m_lock;
+    std::unordered_map<const T *, uint32_t, PointerHash, PointerEquals> m_ids;
+    std::atomic<T *> m_chunks[MaxChunks];
+    std::atomic<uint32_t> m_count;
+    std::atomic<bool> m_full;
+
+public:
+    static constexpr uint32_t OverflowId = 0;
+
+    InternTable() :
+        m_lock(),
+        m_ids(),
+        m_count(0),
+        m_full(false)
+    {
+        for (uint32_t i = 0; i < MaxChunks; ++i)
+        {
+            m_chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~InternTable()
+    {
+        for (uint32_t i = 0; i < MaxChunks; ++i)
+        {
+            delete[] m_chunks[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    InternTable(InternTable& other) = delete;
+    InternTable(InternTable&& other) = delete;
+    InternTable& operator= (InternTable& other) = delete;
+    InternTable& operator= (InternTable&& other) = delete;
+
+    bool TryFind(const T &value, uint32_t *id) const
+    {
+        std::shared_lock lock(m_lock);
+        auto it = m_ids.find(&value);
+        if (it == m_ids.end())
+        {
+            return false;
+        }
+
+        *id = it->second;
+        return true;
+    }
+
+    // Returns the ID for value, adding it if it isn't present. inserted (if non-null) is set
+    // to true when this call created the entry.
+    uint32_t Intern(const T &value, bool *inserted = nullptr)
+    {
+        uint32_t id;
+        if (inserted != nullptr)
+        {
+            *inserted = false;
+        }
+
+        if (TryFind(value, &id))
+        {
+            return id;
+        }
+
+        std::unique_lock lock(m_lock);
+        auto it = m_ids.find(&value);
+        if (it != m_ids.end())
+        {
+            return it->second;
+        }
+
+        id = m_count.load(std::memory_order_relaxed);
+        uint32_t chunkIndex = id >> ChunkBits;
+        if (chunkIndex >= MaxChunks)
+        {
+            m_full.store(true, std::memory_order_relaxed);
+            return OverflowId;
+        }
+
+        T *chunk = m_chunks[chunkIndex].load(std::memory_order_relaxed);
+        if (chunk == nullptr)
+        {
+            chunk = new T[ChunkSize];
+            m_chunks[chunkIndex].store(chunk, std::memory_order_release);
+        }
+
+        T *slot = &chunk[id & (ChunkSize - 1)];
+        *slot = value;
+        m_ids.emplace(slot, id);
+        m_count.store(id + 1, std::memory_order_release);
+
+        if (inserted != nullptr)
+        {
+            *inserted = true;
+        }
+
+        return id;
+    }
+
+    const T &Get(uint32_t id) const
+    {
+        assert(id < Count());
+        T *chunk = m_chunks[id >> ChunkBits].load(std::memory_order_acquire);
+        return chunk[id & (ChunkSize - 1)];
+    }
+
+    uint32_t Count() const
+    {
+        return m_count.load(std::memory_order_acquire);
+    }
+
+    // True once Intern has had to return OverflowId for a new value
+    bool Full() const
+    {
+        return m_full.load(std::memory_order_relaxed);
+    }
+};
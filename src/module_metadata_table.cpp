@@ -0,0 +1,199 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include "module_metadata_table.h"
+
+static constexpr uintptr_t EmptyKey = 0;
+static constexpr uintptr_t TombstoneKey = 1;
+static constexpr size_t MinimumCapacity = 64;
+
+ModuleMetadataTable::Table::Table(size_t capacity) :
+    mask(capacity - 1),
+    entries(new Entry[capacity])
+{
+    for (size_t i = 0; i < capacity; ++i)
+    {
+        entries[i].moduleId.store(EmptyKey, std::memory_order_relaxed);
+        entries[i].metadata = nullptr;
+    }
+}
+
+ModuleMetadataTable::ModuleMetadataTable() :
+    m_table(new Table(MinimumCapacity)),
+    m_writeLock(),
+    m_count(0),
+    m_tombstones(0),
+    m_retiredTables(),
+    m_retiredMetadata()
+{
+
+}
+
+ModuleMetadataTable::~ModuleMetadataTable()
+{
+    Reclaim();
+
+    // The metadata of modules that are still loaded isn't released, this only runs once the
+    // runtime is going away and the importers may already be gone with it
+    delete m_table.load(std::memory_order_relaxed);
+}
+
+size_t ModuleMetadataTable::Hash(ModuleID moduleId, size_t mask)
+{
+    // ModuleIDs are aligned pointers, mix the high bits down before masking
+    uint64_t hash = (uint64_t)moduleId * 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash >> 32) & mask;
+}
+
+void ModuleMetadataTable::Add(Table *table, ModuleID moduleId, IMetaDataImport *metadata)
+{
+    size_t index = Hash(moduleId, table->mask);
+    while (table->entries[index].moduleId.load(std::memory_order_relaxed) != EmptyKey)
+    {
+        index = (index + 1) & table->mask;
+    }
+
+    // The metadata has to be in place before the key is published
+    table->entries[index].metadata = metadata;
+    table->entries[index].moduleId.store((uintptr_t)moduleId, std::memory_order_release);
+}
+
+void ModuleMetadataTable::Grow()
+{
+    Table *oldTable = m_table.load(std::memory_order_relaxed);
+
+    // Sized so the live entries fill at most a quarter, which leaves room for as many loads
+    // again before the next copy. Tombstones aren't carried over.
+    size_t capacity = MinimumCapacity;
+    while (capacity < (m_count + 1) * 4)
+    {
+        capacity <<= 1;
+    }
+
+    Table *newTable = new Table(capacity);
+    for (size_t i = 0; i <= oldTable->mask; ++i)
+    {
+        uintptr_t moduleId = oldTable->entries[i].moduleId.load(std::memory_order_relaxed);
+        if (moduleId != EmptyKey && moduleId != TombstoneKey)
+        {
+            Add(newTable, (ModuleID)moduleId, oldTable->entries[i].metadata);
+        }
+    }
+
+    m_table.store(newTable, std::memory_order_release);
+    m_retiredTables.push_back(oldTable);
+    m_tombstones = 0;
+}
+
+void ModuleMetadataTable::Insert(ModuleID moduleId, IMetaDataImport *metadata)
+{
+    std::lock_guard<std::mutex> lock(m_writeLock);
+
+    // A module shouldn't be loaded twice without an unload, but if it is the newer metadata wins
+    Table *table = m_table.load(std::memory_order_relaxed);
+    size_t index = Hash(moduleId, table->mask);
+    while (true)
+    {
+        uintptr_t key = table->entries[index].moduleId.load(std::memory_order_relaxed);
+        if (key == EmptyKey)
+        {
+            break;
+        }
+
+        if (key == (uintptr_t)moduleId)
+        {
+            table->entries[index].moduleId.store(TombstoneKey, std::memory_order_release);
+            m_retiredMetadata.push_back(table->entries[index].metadata);
+            ++m_tombstones;
+            --m_count;
+            break;
+        }
+
+        index = (index + 1) & table->mask;
+    }
+
+    // Keep at least half the entries empty so probes stay short and always end
+    if ((m_count + m_tombstones + 1) * 2 > table->mask + 1)
+    {
+        Grow();
+        table = m_table.load(std::memory_order_relaxed);
+    }
+
+    Add(table, moduleId, metadata);
+    ++m_count;
+}
+
+void ModuleMetadataTable::Remove(ModuleID moduleId)
+{
+    std::lock_guard<std::mutex> lock(m_writeLock);
+
+    Table *table = m_table.load(std::memory_order_relaxed);
+    size_t index = Hash(moduleId, table->mask);
+    while (true)
+    {
+        uintptr_t key = table->entries[index].moduleId.load(std::memory_order_relaxed);
+        if (key == EmptyKey)
+        {
+            return;
+        }
+
+        if (key == (uintptr_t)moduleId)
+        {
+            table->entries[index].moduleId.store(TombstoneKey, std::memory_order_release);
+            m_retiredMetadata.push_back(table->entries[index].metadata);
+            ++m_tombstones;
+            --m_count;
+            return;
+        }
+
+        index = (index + 1) & table->mask;
+    }
+}
+
+IMetaDataImport *ModuleMetadataTable::Find(ModuleID moduleId) const
+{
+    const Table *table = m_table.load(std::memory_order_acquire);
+    size_t index = Hash(moduleId, table->mask);
+    while (true)
+    {
+        uintptr_t key = table->entries[index].moduleId.load(std::memory_order_acquire);
+        if (key == (uintptr_t)moduleId)
+        {
+            return table->entries[index].metadata;
+        }
+
+        if (key == EmptyKey)
+        {
+            return nullptr;
+        }
+
+        index = (index + 1) & table->mask;
+    }
+}
+
+void ModuleMetadataTable::Reclaim()
+{
+    std::vector<Table *> tables;
+    std::vector<IMetaDataImport *> metadata;
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+        if (m_retiredTables.empty() && m_retiredMetadata.empty())
+        {
+            return;
+        }
+
+        tables.swap(m_retiredTables);
+        metadata.swap(m_retiredMetadata);
+    }
+
+    for (Table *table : tables)
+    {
+        delete table;
+    }
+
+    for (IMetaDataImport *import : metadata)
+    {
+        import->Release();
+    }
+}
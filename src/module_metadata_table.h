@@ -0,0 +1,78 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "cor.h"
+#include "corprof.h"
+
+// ModuleID -> IMetaDataImport for every loaded module. Written on module load and unload,
+// read for nearly every frame symbolized, so the read side is a handful of plain loads.
+//
+// The table is an open addressed array published through an atomic pointer. Loads add to the
+// current array in place (value first, then the key with a release store) and only copy it
+// when it's half full, unloads tombstone the key. Neither ever frees anything a reader could
+// still be looking at: replaced arrays and the metadata of unloaded modules go on a retired
+// list, and Reclaim releases them once the sampling thread knows nobody is mid lookup.
+//
+// So a pointer from Find is good until the next Reclaim, which the sampling thread calls at
+// the start of each tick.
+class ModuleMetadataTable
+{
+private:
+    struct Entry
+    {
+        std::atomic<uintptr_t> moduleId;
+        IMetaDataImport *metadata;
+    };
+
+    struct Table
+    {
+        size_t mask;
+        std::unique_ptr<Entry[]> entries;
+
+        Table(size_t capacity);
+    };
+
+    std::atomic<Table *> m_table;
+
+    // Everything below is only touched with m_writeLock held
+    std::mutex m_writeLock;
+    size_t m_count;
+    size_t m_tombstones;
+    std::vector<Table *> m_retiredTables;
+    std::vector<IMetaDataImport *> m_retiredMetadata;
+
+    static size_t Hash(ModuleID moduleId, size_t mask);
+    // Inserts in to a table nobody else can see yet, or with m_writeLock held
+    static void Add(Table *table, ModuleID moduleId, IMetaDataImport *metadata);
+    void Grow();
+
+public:
+    ModuleMetadataTable();
+    ~ModuleMetadataTable();
+
+    ModuleMetadataTable(ModuleMetadataTable& other) = delete;
+    ModuleMetadataTable(ModuleMetadataTable&& other) = delete;
+    ModuleMetadataTable& operator= (ModuleMetadataTable& other) = delete;
+    ModuleMetadataTable& operator= (ModuleMetadataTable&& other) = delete;
+
+    // Takes over the reference to metadata
+    void Insert(ModuleID moduleId, IMetaDataImport *metadata);
+    // Lookups stop finding the module straight away, the metadata is released by Reclaim
+    void Remove(ModuleID moduleId);
+
+    // nullptr if the module isn't loaded
+    IMetaDataImport *Find(ModuleID moduleId) const;
+
+    // Frees what earlier writes retired. Only safe when no thread is between a Find and its
+    // last use of the result.
+    void Reclaim();
+};
@@ -0,0 +1,108 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "unwind_table.h"
+
+// Maps native instruction pointers to symbol names.
+//
+// On linux this doesn't go through dladdr, which takes the loader lock, scans every loaded
+// object linearly and only knows about exported symbols (most of libcoreclr comes back as
+// Unknown). Instead the loaded objects are enumerated once with dl_iterate_phdr and each one's
+// file is mapped so its .symtab and .dynsym can be read in to a table sorted by address. A
+// lookup is then two binary searches. When an address isn't inside any known object the list
+// of objects is checked again at the next Update, so libraries loaded later get picked up
+// without re-reading the ones that were already there. On macos this is dladdr.
+//
+// The same mapped images also supply each object's .eh_frame, which is turned in to an
+// UnwindTable the first time a stack walk needs it, so frames without a frame pointer can be
+// stepped over.
+//
+// The module list only changes in Update, which the sampling thread calls at the start of a
+// tick while nothing else is using it. Between Updates any number of threads can call the
+// lookup methods at once.
+class NativeSymbolizer
+{
+private:
+    FILE *m_outputFile;
+
+#ifdef __linux__
+    struct Symbol
+    {
+        uintptr_t start;
+        uintptr_t end;
+        // Points in to the module's mapped image
+        const char *name;
+    };
+
+    struct Module
+    {
+        std::string path;
+        // What the object's addresses are relocated by
+        uintptr_t bias;
+        // Range covered by its PT_LOAD segments
+        uintptr_t start;
+        uintptr_t end;
+
+        void *image;
+        size_t imageSize;
+        std::vector<Symbol> symbols;
+
+        // Where .eh_frame is in the image and in the object, size is 0 if there isn't one
+        size_t ehFrameOffset;
+        size_t ehFrameSize;
+        uintptr_t ehFrameAddress;
+        std::once_flag unwindTableBuilt;
+        UnwindTable unwindTable;
+
+        Module();
+        ~Module();
+    };
+
+    // Sorted by start
+    std::vector<std::unique_ptr<Module>> m_modules;
+    uint64_t m_loadCount;
+    uint64_t m_unloadCount;
+    uint64_t m_lastScan;
+    std::atomic<bool> m_scanWanted;
+
+    Module *FindModule(uintptr_t ip);
+    bool NeedsScan();
+    void Scan();
+    void LoadSymbols(Module *module);
+#endif // __linux__
+
+public:
+    NativeSymbolizer(FILE *outputFile);
+    ~NativeSymbolizer();
+
+    NativeSymbolizer(NativeSymbolizer& other) = delete;
+    NativeSymbolizer(NativeSymbolizer&& other) = delete;
+    NativeSymbolizer& operator= (NativeSymbolizer& other) = delete;
+    NativeSymbolizer& operator= (NativeSymbolizer&& other) = delete;
+
+    // Lists the loaded objects again if a lookup missed since the last Update and anything was
+    // loaded or unloaded since. Returns true if it did, lookups that missed before may not now.
+    bool Update();
+
+    // True if ip is inside a loaded native object as of the last time they were listed, so it
+    // can't be managed code. Always false on macos.
+    bool Contains(uintptr_t ip);
+
+    // Returns false if ip isn't in a known symbol. name is only good until the next Lookup.
+    bool Lookup(uintptr_t ip, const char **name, uintptr_t *offset);
+
+    // How to unwind a frame stopped at ip. False if ip isn't in a known object or its .eh_frame
+    // doesn't cover it. Always false on macos.
+    bool FindUnwindRule(uintptr_t ip, UnwindRule *rule);
+};
@@ -0,0 +1,421 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "native_symbolizer.h"
+
+// An address outside every known object is usually JIT'd code or a stub rather than a new
+// library, so don't ask the loader again more often than this
+static constexpr uint64_t MinScanIntervalNs = 1000 * 1000 * 1000;
+
+struct LoadedObject
+{
+    std::string path;
+    uintptr_t bias;
+    uintptr_t start;
+    uintptr_t end;
+};
+
+struct LoadCounts
+{
+    uint64_t loads;
+    uint64_t unloads;
+};
+
+static bool ReadLoadCounts(struct dl_phdr_info *info, size_t size, LoadCounts *counts)
+{
+    // dlpi_adds/dlpi_subs were added to the struct later, size says whether they're there
+    if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+    {
+        return false;
+    }
+
+    counts->loads = info->dlpi_adds;
+    counts->unloads = info->dlpi_subs;
+    return true;
+}
+
+static int GetLoadCountsCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+    if (!ReadLoadCounts(info, size, (LoadCounts *)data))
+    {
+        // Can't tell if anything changed, make it look like something did
+        ((LoadCounts *)data)->loads = UINT64_MAX;
+    }
+
+    // The counts are the same for every object, one is enough
+    return 1;
+}
+
+static int ListObjectsCallback(struct dl_phdr_info *info, size_t size, void *data)
+{
+    std::vector<LoadedObject> *objects = (std::vector<LoadedObject> *)data;
+
+    LoadedObject object;
+    object.bias = (uintptr_t)info->dlpi_addr;
+    object.start = UINTPTR_MAX;
+    object.end = 0;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i)
+    {
+        const ElfW(Phdr) &header = info->dlpi_phdr[i];
+        if (header.p_type != PT_LOAD)
+        {
+            continue;
+        }
+
+        object.start = std::min(object.start, object.bias + (uintptr_t)header.p_vaddr);
+        object.end = std::max(object.end, object.bias + (uintptr_t)(header.p_vaddr + header.p_memsz));
+    }
+
+    if (object.start >= object.end)
+    {
+        return 0;
+    }
+
+    if (info->dlpi_name != nullptr && info->dlpi_name[0] != '\0')
+    {
+        object.path = info->dlpi_name;
+    }
+    else if (objects->empty())
+    {
+        // The main program comes first and doesn't have a name
+        char path[PATH_MAX];
+        ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if (length > 0)
+        {
+            object.path.assign(path, (size_t)length);
+        }
+    }
+
+    objects->push_back(std::move(object));
+    return 0;
+}
+
+NativeSymbolizer::Module::Module() :
+    path(),
+    bias(0),
+    start(0),
+    end(0),
+    image(nullptr),
+    imageSize(0),
+    symbols(),
+    ehFrameOffset(0),
+    ehFrameSize(0),
+    ehFrameAddress(0),
+    unwindTableBuilt(),
+    unwindTable()
+{
+
+}
+
+NativeSymbolizer::Module::~Module()
+{
+    if (image != nullptr)
+    {
+        munmap(image, imageSize);
+    }
+}
+
+NativeSymbolizer::NativeSymbolizer(FILE *outputFile) :
+    m_outputFile(outputFile),
+    m_modules(),
+    m_loadCount(0),
+    m_unloadCount(0),
+    m_lastScan(0),
+    m_scanWanted(false)
+{
+    Scan();
+}
+
+NativeSymbolizer::~NativeSymbolizer()
+{
+
+}
+
+NativeSymbolizer::Module *NativeSymbolizer::FindModule(uintptr_t ip)
+{
+    auto it = std::upper_bound(m_modules.begin(), m_modules.end(), ip,
+        [](uintptr_t address, const std::unique_ptr<Module> &module) { return address < module->start; });
+    if (it == m_modules.begin())
+    {
+        return nullptr;
+    }
+
+    Module *module = (--it)->get();
+    return ip < module->end ? module : nullptr;
+}
+
+bool NativeSymbolizer::NeedsScan()
+{
+    m_lastScan = GetTimestamp();
+
+    LoadCounts counts = { 0, 0 };
+    dl_iterate_phdr(GetLoadCountsCallback, &counts);
+    return counts.loads != m_loadCount || counts.unloads != m_unloadCount;
+}
+
+void NativeSymbolizer::Scan()
+{
+    m_lastScan = GetTimestamp();
+
+    LoadCounts counts = { UINT64_MAX, UINT64_MAX };
+    dl_iterate_phdr(GetLoadCountsCallback, &counts);
+
+    std::vector<LoadedObject> objects;
+    dl_iterate_phdr(ListObjectsCallback, &objects);
+
+    // Anything that's still loaded at the same place keeps the symbols it already has, only
+    // new objects are read
+    std::vector<std::unique_ptr<Module>> modules;
+    modules.reserve(objects.size());
+    for (LoadedObject &object : objects)
+    {
+        auto existing = std::find_if(m_modules.begin(), m_modules.end(),
+            [&object](const std::unique_ptr<Module> &module)
+            {
+                return module != nullptr && module->bias == object.bias && module->path == object.path;
+            });
+        if (existing != m_modules.end())
+        {
+            modules.push_back(std::move(*existing));
+            continue;
+        }
+
+        std::unique_ptr<Module> module(new Module());
+        module->path = std::move(object.path);
+        module->bias = object.bias;
+        module->start = object.start;
+        module->end = object.end;
+        LoadSymbols(module.get());
+        modules.push_back(std::move(module));
+    }
+
+    std::sort(modules.begin(), modules.end(),
+        [](const std::unique_ptr<Module> &left, const std::unique_ptr<Module> &right) { return left->start < right->start; });
+
+    m_modules = std::move(modules);
+    m_loadCount = counts.loads;
+    m_unloadCount = counts.unloads;
+}
+
+void NativeSymbolizer::LoadSymbols(Module *module)
+{
+    // Things like the vdso don't have a file behind them
+    if (module->path.empty() || module->path[0] != '/')
+    {
+        return;
+    }
+
+    int fd = open(module->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(m_outputFile, "Unable to open %s errno=%d, its native frames won't have names\n", module->path.c_str(), errno);
+        return;
+    }
+
+    struct stat fileInfo;
+    void *image = MAP_FAILED;
+    if (fstat(fd, &fileInfo) == 0 && (size_t)fileInfo.st_size >= sizeof(ElfW(Ehdr)))
+    {
+        image = mmap(nullptr, (size_t)fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+    if (image == MAP_FAILED)
+    {
+        fprintf(m_outputFile, "Unable to map %s, its native frames won't have names\n", module->path.c_str());
+        return;
+    }
+
+    // The names point in to the image, so it stays mapped as long as the module is loaded
+    module->image = image;
+    module->imageSize = (size_t)fileInfo.st_size;
+
+    const char *base = (const char *)image;
+    const ElfW(Ehdr) *header = (const ElfW(Ehdr) *)base;
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0
+        || header->e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32)
+        || header->e_shentsize != sizeof(ElfW(Shdr))
+        || header->e_shoff > module->imageSize
+        || (size_t)header->e_shnum * sizeof(ElfW(Shdr)) > module->imageSize - header->e_shoff)
+    {
+        return;
+    }
+
+    const ElfW(Shdr) *sections = (const ElfW(Shdr) *)(base + header->e_shoff);
+    const ElfW(Shdr) *sectionNames = header->e_shstrndx < header->e_shnum ? &sections[header->e_shstrndx] : nullptr;
+    if (sectionNames != nullptr
+        && (sectionNames->sh_offset > module->imageSize || sectionNames->sh_size > module->imageSize - sectionNames->sh_offset))
+    {
+        sectionNames = nullptr;
+    }
+
+    // .symtab has everything the linker saw, .dynsym only the exports. A stripped library only
+    // has the second, and most have both, so both are read and duplicates dropped below.
+    for (ElfW(Half) i = 0; i < header->e_shnum; ++i)
+    {
+        const ElfW(Shdr) &section = sections[i];
+        // lld gives .eh_frame the x86-64 specific unwind type rather than PROGBITS, and the
+        // runtime is built with clang, so anything but a section without contents goes
+        if (section.sh_type != SHT_NOBITS
+            && sectionNames != nullptr
+            && section.sh_name < sectionNames->sh_size
+            && strncmp(base + sectionNames->sh_offset + section.sh_name, ".eh_frame", sectionNames->sh_size - section.sh_name) == 0
+            && section.sh_offset <= module->imageSize
+            && section.sh_size <= module->imageSize - section.sh_offset)
+        {
+            // Only remembered here, it's parsed the first time a stack is unwound through it
+            module->ehFrameOffset = (size_t)section.sh_offset;
+            module->ehFrameSize = (size_t)section.sh_size;
+            module->ehFrameAddress = (uintptr_t)section.sh_addr;
+            continue;
+        }
+
+        if ((section.sh_type != SHT_SYMTAB && section.sh_type != SHT_DYNSYM)
+            || section.sh_link >= header->e_shnum
+            || section.sh_offset > module->imageSize
+            || section.sh_size > module->imageSize - section.sh_offset)
+        {
+            continue;
+        }
+
+        const ElfW(Shdr) &strings = sections[section.sh_link];
+        if (strings.sh_offset > module->imageSize || strings.sh_size > module->imageSize - strings.sh_offset)
+        {
+            continue;
+        }
+
+        const ElfW(Sym) *symbols = (const ElfW(Sym) *)(base + section.sh_offset);
+        size_t symbolCount = section.sh_size / sizeof(ElfW(Sym));
+        const char *names = base + strings.sh_offset;
+        for (size_t j = 0; j < symbolCount; ++j)
+        {
+            const ElfW(Sym) &symbol = symbols[j];
+            unsigned char type = ELF64_ST_TYPE(symbol.st_info);
+            if ((type != STT_FUNC && type != STT_GNU_IFUNC)
+                || symbol.st_shndx == SHN_UNDEF
+                || symbol.st_value == 0
+                || symbol.st_name == 0
+                || symbol.st_name >= strings.sh_size)
+            {
+                continue;
+            }
+
+            Symbol entry;
+            entry.start = module->bias + (uintptr_t)symbol.st_value;
+            entry.end = symbol.st_size != 0 ? entry.start + (uintptr_t)symbol.st_size : 0;
+            entry.name = names + symbol.st_name;
+            module->symbols.push_back(entry);
+        }
+    }
+
+    // Where several names share an address keep the one that has a size
+    std::vector<Symbol> &symbols = module->symbols;
+    std::sort(symbols.begin(), symbols.end(),
+        [](const Symbol &left, const Symbol &right)
+        {
+            return left.start != right.start ? left.start < right.start : left.end > right.end;
+        });
+    symbols.erase(std::unique(symbols.begin(), symbols.end(),
+        [](const Symbol &left, const Symbol &right) { return left.start == right.start; }),
+        symbols.end());
+
+    // Hand written assembly often has no size, it gets everything up to the next symbol
+    for (size_t i = 0; i < symbols.size(); ++i)
+    {
+        if (symbols[i].end == 0)
+        {
+            symbols[i].end = i + 1 < symbols.size() ? symbols[i + 1].start : module->end;
+        }
+    }
+
+    symbols.shrink_to_fit();
+}
+
+bool NativeSymbolizer::Update()
+{
+    // A miss too soon after the last check stays wanted until the interval is up. The sampler
+    // remembers IPs that missed, so they won't come through Lookup to ask again.
+    if (!m_scanWanted.load(std::memory_order_relaxed) || GetTimestamp() - m_lastScan < MinScanIntervalNs)
+    {
+        return false;
+    }
+
+    m_scanWanted.store(false, std::memory_order_relaxed);
+    if (!NeedsScan())
+    {
+        return false;
+    }
+
+    Scan();
+    return true;
+}
+
+bool NativeSymbolizer::Contains(uintptr_t ip)
+{
+    return FindModule(ip) != nullptr;
+}
+
+bool NativeSymbolizer::Lookup(uintptr_t ip, const char **name, uintptr_t *offset)
+{
+    Module *module = FindModule(ip);
+    if (module == nullptr)
+    {
+        m_scanWanted.store(true, std::memory_order_relaxed);
+        return false;
+    }
+
+    const std::vector<Symbol> &symbols = module->symbols;
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), ip,
+        [](uintptr_t address, const Symbol &symbol) { return address < symbol.start; });
+    if (it == symbols.begin())
+    {
+        return false;
+    }
+
+    --it;
+    if (ip >= it->end)
+    {
+        return false;
+    }
+
+    *name = it->name;
+    *offset = ip - it->start;
+    return true;
+}
+
+bool NativeSymbolizer::FindUnwindRule(uintptr_t ip, UnwindRule *rule)
+{
+    // Misses don't ask for a rescan, Lookup picks up new objects soon enough and until then the
+    // caller falls back to the frame pointer
+    Module *module = FindModule(ip);
+    if (module == nullptr || module->ehFrameSize == 0)
+    {
+        return false;
+    }
+
+    // Stack walks can run on several threads, whichever gets here first builds the table
+    std::call_once(module->unwindTableBuilt, [this, module]()
+    {
+        size_t rows = module->unwindTable.Build((const uint8_t *)module->image + module->ehFrameOffset,
+            module->ehFrameSize, module->ehFrameAddress);
+        if (rows == 0)
+        {
+            fprintf(m_outputFile, "No usable unwind info in %s, falling back to frame pointers for it\n", module->path.c_str());
+        }
+    });
+
+    return module->unwindTable.Find(ip - module->bias, rule);
+}
@@ -0,0 +1,49 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <dlfcn.h>
+
+#include "native_symbolizer.h"
+
+NativeSymbolizer::NativeSymbolizer(FILE *outputFile) :
+    m_outputFile(outputFile)
+{
+
+}
+
+NativeSymbolizer::~NativeSymbolizer()
+{
+
+}
+
+bool NativeSymbolizer::Update()
+{
+    // dladdr always sees what's loaded right now
+    return false;
+}
+
+bool NativeSymbolizer::Contains(uintptr_t ip)
+{
+    // dladdr would answer this, but it costs as much as the GetFunctionFromIP it would save
+    return false;
+}
+
+bool NativeSymbolizer::Lookup(uintptr_t ip, const char **name, uintptr_t *offset)
+{
+    Dl_info info;
+    if (dladdr((void *)ip, &info) == 0 || info.dli_sname == nullptr)
+    {
+        return false;
+    }
+
+    *name = info.dli_sname;
+    *offset = ip - (uintptr_t)info.dli_saddr;
+    return true;
+}
+
+bool NativeSymbolizer::FindUnwindRule(uintptr_t ip, UnwindRule *rule)
+{
+    // Mach-O keeps its unwind info in __unwind_info, which isn't read yet
+    return false;
+}
@@ -0,0 +1,58 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <algorithm>
+#include <cmath>
+
+#include "overhead_governor.h"
+
+// How much weight the newest tick gets in the running average
+static constexpr double CostSmoothing = 0.2;
+
+OverheadGovernor::OverheadGovernor(double budget, uint64_t baseIntervalNs, uint64_t maxIntervalNs) :
+    m_budget(budget),
+    m_maxMultiplier((uint32_t)std::max<uint64_t>(1, maxIntervalNs / baseIntervalNs)),
+    m_multiplier(1),
+    m_baseIntervalNs(baseIntervalNs),
+    m_averageCostNs(0)
+{
+
+}
+
+uint32_t OverheadGovernor::Update(const TickCost &cost)
+{
+    if (!Enabled())
+    {
+        return m_multiplier;
+    }
+
+    double tickCost = (double)cost.Total();
+    if (m_averageCostNs == 0)
+    {
+        m_averageCostNs = tickCost;
+    }
+    else
+    {
+        m_averageCostNs += (tickCost - m_averageCostNs) * CostSmoothing;
+    }
+
+    // Cost per tick doesn't depend on the interval, so the interval that fits the budget is
+    // cost / budget
+    double wantedIntervalNs = m_averageCostNs / m_budget;
+    uint32_t wanted = (uint32_t)std::min<double>(m_maxMultiplier, std::max(1.0, std::ceil(wantedIntervalNs / m_baseIntervalNs)));
+
+    if (wanted > m_multiplier)
+    {
+        m_multiplier = wanted;
+    }
+    else if (wanted < m_multiplier)
+    {
+        // Give back at most a quarter of the interval per tick so a quiet stretch doesn't
+        // swing straight back to the full rate
+        uint32_t step = std::max<uint32_t>(1, m_multiplier / 4);
+        m_multiplier = std::max(wanted, m_multiplier - step);
+    }
+
+    return m_multiplier;
+}
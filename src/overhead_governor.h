@@ -0,0 +1,66 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdint>
+
+// What one sampling tick cost, in nanoseconds. The parts can overlap (the sampling thread
+// keeps running while the runtime is suspended) so the total errs on the high side.
+struct TickCost
+{
+    // Wall time the runtime was suspended, every managed thread is stalled for this long
+    uint64_t suspendedNs;
+    // Time spent in the signal handlers of the sampled threads
+    uint64_t handlerNs;
+    // CPU time of the sampling thread, mostly walking stacks and resolving symbols
+    uint64_t samplingNs;
+    // CPU time the background writer spent writing samples out
+    uint64_t writingNs;
+
+    uint64_t Total() const
+    {
+        return suspendedNs + handlerNs + samplingNs + writingNs;
+    }
+};
+
+// Keeps the sampler under an overhead budget, expressed as a fraction of one core. After every
+// tick it is told what the tick cost and picks the interval multiplier that would keep
+// cost / interval under the budget. Intervals are always a whole multiple of the configured
+// interval, so sample weights stay exact when the rate changes.
+//
+// The cost is smoothed so a single slow tick (a GC, a burst of new methods to resolve) doesn't
+// throw the rate around. Slowing down happens at once, speeding back up a step at a time.
+class OverheadGovernor
+{
+private:
+    double m_budget;
+    uint32_t m_maxMultiplier;
+    uint32_t m_multiplier;
+    uint64_t m_baseIntervalNs;
+    double m_averageCostNs;
+
+public:
+    // budget is a fraction of one core, 0 disables the governor
+    OverheadGovernor(double budget, uint64_t baseIntervalNs, uint64_t maxIntervalNs);
+    ~OverheadGovernor() = default;
+
+    bool Enabled() const
+    {
+        return m_budget > 0;
+    }
+
+    uint32_t Multiplier() const
+    {
+        return m_multiplier;
+    }
+
+    double AverageCostNs() const
+    {
+        return m_averageCostNs;
+    }
+
+    // Returns the multiplier to use from the next tick on
+    uint32_t Update(const TickCost &cost);
+};
@@ -0,0 +1,320 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <chrono>
+#include <cstdio>
+#include <dlfcn.h>
+
+#include "CorProfiler.h"
+#include "pprof_writer.h"
+
+// Field numbers from profile.proto
+namespace ProfileField
+{
+    static constexpr uint32_t SampleType = 1;
+    static constexpr uint32_t Sample = 2;
+    static constexpr uint32_t Mapping = 3;
+    static constexpr uint32_t Location = 4;
+    static constexpr uint32_t Function = 5;
+    static constexpr uint32_t StringTable = 6;
+    static constexpr uint32_t TimeNanos = 9;
+    static constexpr uint32_t DurationNanos = 10;
+    static constexpr uint32_t PeriodType = 11;
+    static constexpr uint32_t Period = 12;
+}
+
+namespace ValueTypeField
+{
+    static constexpr uint32_t Type = 1;
+    static constexpr uint32_t Unit = 2;
+}
+
+namespace SampleField
+{
+    static constexpr uint32_t LocationId = 1;
+    static constexpr uint32_t Value = 2;
+    static constexpr uint32_t Label = 3;
+}
+
+namespace LabelField
+{
+    static constexpr uint32_t Key = 1;
+    static constexpr uint32_t Num = 3;
+}
+
+namespace MappingField
+{
+    static constexpr uint32_t Id = 1;
+    static constexpr uint32_t MemoryStart = 2;
+    static constexpr uint32_t Filename = 5;
+    static constexpr uint32_t HasFunctions = 7;
+}
+
+namespace LocationField
+{
+    static constexpr uint32_t Id = 1;
+    static constexpr uint32_t MappingId = 2;
+    static constexpr uint32_t Address = 3;
+    static constexpr uint32_t Line = 4;
+}
+
+namespace LineField
+{
+    static constexpr uint32_t FunctionId = 1;
+}
+
+namespace FunctionField
+{
+    static constexpr uint32_t Id = 1;
+    static constexpr uint32_t Name = 2;
+    static constexpr uint32_t SystemName = 3;
+    static constexpr uint32_t Filename = 4;
+}
+
+// Mapping 1 stands for all managed code, native images are numbered after it
+static constexpr uint32_t ManagedMappingId = 1;
+static constexpr uint32_t FirstNativeMappingId = 2;
+
+PprofSampleWriter::PprofSampleWriter(BackgroundWriter &output,
+                                     SymbolCache &symbolCache,
+                                     StackTrie &stackTrie,
+                                     const std::string &filePrefix,
+                                     uint64_t windowNs,
+                                     uint64_t samplingIntervalNs,
+                                     const char *timeType) :
+    SampleWriter(output, symbolCache, stackTrie),
+    m_filePrefix(filePrefix),
+    m_fileCount(0),
+    m_windowNs(windowNs),
+    m_samplingIntervalNs(samplingIntervalNs),
+    m_timeType(timeType),
+    m_windowStart(0),
+    m_windowStartWallNs(0),
+    m_counts(),
+    m_nativeMappings(),
+    m_mappingsByBase(),
+    m_frameMappings(),
+    m_stringIndexes(),
+    m_stringTable()
+{
+
+}
+
+void PprofSampleWriter::WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight)
+{
+    if (m_windowStart == 0)
+    {
+        m_windowStart = timestamp;
+        m_windowStartWallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    SampleTotals &totals = m_counts[SampleKey { stackId, threadID }];
+    totals.count += 1;
+    totals.weight += weight;
+}
+
+void PprofSampleWriter::TickFinished(uint64_t timestamp)
+{
+    if (m_windowStart != 0 && timestamp - m_windowStart >= m_windowNs)
+    {
+        WriteProfile(timestamp);
+    }
+}
+
+void PprofSampleWriter::Finish(uint64_t timestamp)
+{
+    // The last window is cut short, a run shorter than one window only has this profile
+    WriteProfile(timestamp);
+}
+
+uint64_t PprofSampleWriter::GetStringIndex(uint32_t stringId)
+{
+    auto it = m_stringIndexes.find(stringId);
+    if (it != m_stringIndexes.end())
+    {
+        return it->second;
+    }
+
+    uint64_t index = m_stringTable.size();
+    m_stringTable.push_back(stringId);
+    m_stringIndexes.emplace(stringId, index);
+    return index;
+}
+
+uint32_t PprofSampleWriter::GetMappingId(uint32_t frameId, const Frame &frame)
+{
+    if (frame.kind == FrameKind::Managed)
+    {
+        return ManagedMappingId;
+    }
+
+    auto frameIt = m_frameMappings.find(frameId);
+    if (frameIt != m_frameMappings.end())
+    {
+        return frameIt->second;
+    }
+
+    uint32_t mappingId = 0;
+    Dl_info info;
+    if (dladdr((void *)frame.address, &info) != 0 && info.dli_fname != nullptr)
+    {
+        uint64_t baseAddress = (uint64_t)info.dli_fbase;
+        auto baseIt = m_mappingsByBase.find(baseAddress);
+        if (baseIt != m_mappingsByBase.end())
+        {
+            mappingId = baseIt->second;
+        }
+        else
+        {
+            mappingId = FirstNativeMappingId + (uint32_t)m_nativeMappings.size();
+            m_nativeMappings.push_back(NativeMapping { baseAddress, m_symbolCache.InternString(info.dli_fname) });
+            m_mappingsByBase.emplace(baseAddress, mappingId);
+        }
+    }
+
+    m_frameMappings.emplace(frameId, mappingId);
+    return mappingId;
+}
+
+void PprofSampleWriter::EncodeValueType(ProtobufEncoder &profile, uint32_t field, const char *type, const char *unit)
+{
+    ProtobufEncoder valueType;
+    valueType.WriteVarint(ValueTypeField::Type, GetStringIndex(type));
+    valueType.WriteVarint(ValueTypeField::Unit, GetStringIndex(unit));
+    profile.WriteMessage(field, valueType);
+}
+
+void PprofSampleWriter::WriteProfile(uint64_t endTimestamp)
+{
+    if (m_counts.empty())
+    {
+        return;
+    }
+
+    // string_table[0] has to be the empty string
+    m_stringIndexes.clear();
+    m_stringTable.clear();
+    GetStringIndex("");
+
+    ProtobufEncoder profile;
+    EncodeValueType(profile, ProfileField::SampleType, "samples", "count");
+    EncodeValueType(profile, ProfileField::SampleType, m_timeType, "nanoseconds");
+
+    uint64_t threadKey = GetStringIndex("thread");
+    std::vector<uint32_t> usedFrames;
+    std::vector<bool> isFrameUsed(m_stackTrie.FrameCount(), false);
+
+    ProtobufEncoder sample;
+    ProtobufEncoder label;
+    std::vector<uint64_t> locationIds;
+    for (const auto &entry : m_counts)
+    {
+        // pprof wants the leaf first, which is the order the parent links give us
+        locationIds.clear();
+        uint32_t stackId = entry.first.stackId;
+        while (stackId != StackTrie::RootStackId)
+        {
+            const StackNode &node = m_stackTrie.GetNode(stackId);
+            if (!isFrameUsed[node.frameId])
+            {
+                isFrameUsed[node.frameId] = true;
+                usedFrames.push_back(node.frameId);
+            }
+
+            // Location IDs must be non zero
+            locationIds.push_back((uint64_t)node.frameId + 1);
+            stackId = node.parent;
+        }
+
+        sample.Clear();
+        sample.WritePackedVarints(SampleField::LocationId, locationIds);
+        sample.WritePackedVarints(SampleField::Value, { entry.second.count, entry.second.weight * m_samplingIntervalNs });
+
+        label.Clear();
+        label.WriteVarint(LabelField::Key, threadKey);
+        label.WriteVarint(LabelField::Num, (uint64_t)entry.first.threadID);
+        sample.WriteMessage(SampleField::Label, label);
+
+        profile.WriteMessage(ProfileField::Sample, sample);
+    }
+
+    // One function per distinct name, shared by every location that resolves to it
+    std::unordered_map<uint32_t, uint32_t> functionMappings;
+    ProtobufEncoder location;
+    ProtobufEncoder line;
+    for (uint32_t frameId : usedFrames)
+    {
+        const Frame &frame = m_stackTrie.GetFrame(frameId);
+        uint32_t mappingId = GetMappingId(frameId, frame);
+        functionMappings.emplace(frame.nameId, mappingId);
+
+        line.Clear();
+        line.WriteVarint(LineField::FunctionId, (uint64_t)frame.nameId + 1);
+
+        location.Clear();
+        location.WriteVarint(LocationField::Id, (uint64_t)frameId + 1);
+        location.WriteVarint(LocationField::MappingId, mappingId);
+        if (frame.kind == FrameKind::Native)
+        {
+            location.WriteVarint(LocationField::Address, frame.address);
+        }
+        location.WriteMessage(LocationField::Line, line);
+
+        profile.WriteMessage(ProfileField::Location, location);
+    }
+
+    ProtobufEncoder function;
+    for (const auto &entry : functionMappings)
+    {
+        uint64_t nameIndex = GetStringIndex(entry.first);
+
+        function.Clear();
+        function.WriteVarint(FunctionField::Id, (uint64_t)entry.first + 1);
+        function.WriteVarint(FunctionField::Name, nameIndex);
+        function.WriteVarint(FunctionField::SystemName, nameIndex);
+        if (entry.second >= FirstNativeMappingId)
+        {
+            const NativeMapping &mapping = m_nativeMappings[entry.second - FirstNativeMappingId];
+            function.WriteVarint(FunctionField::Filename, GetStringIndex(mapping.fileNameId));
+        }
+
+        profile.WriteMessage(ProfileField::Function, function);
+    }
+
+    ProtobufEncoder mapping;
+    mapping.WriteVarint(MappingField::Id, ManagedMappingId);
+    mapping.WriteVarint(MappingField::Filename, GetStringIndex("[managed]"));
+    mapping.WriteBool(MappingField::HasFunctions, true);
+    profile.WriteMessage(ProfileField::Mapping, mapping);
+
+    for (size_t i = 0; i < m_nativeMappings.size(); ++i)
+    {
+        mapping.Clear();
+        mapping.WriteVarint(MappingField::Id, FirstNativeMappingId + i);
+        mapping.WriteVarint(MappingField::MemoryStart, m_nativeMappings[i].baseAddress);
+        mapping.WriteVarint(MappingField::Filename, GetStringIndex(m_nativeMappings[i].fileNameId));
+        mapping.WriteBool(MappingField::HasFunctions, true);
+        profile.WriteMessage(ProfileField::Mapping, mapping);
+    }
+
+    profile.WriteVarint(ProfileField::TimeNanos, m_windowStartWallNs);
+    profile.WriteVarint(ProfileField::DurationNanos, endTimestamp - m_windowStart);
+    EncodeValueType(profile, ProfileField::PeriodType, m_timeType, "nanoseconds");
+    profile.WriteVarint(ProfileField::Period, m_samplingIntervalNs);
+
+    // Field order doesn't matter on the wire, so the string table goes last once everything
+    // above has added its strings
+    for (uint32_t stringId : m_stringTable)
+    {
+        profile.WriteString(ProfileField::StringTable, m_symbolCache.GetString(stringId));
+    }
+
+    // Encoding is all in memory, creating the file is left to the I/O thread
+    std::string fileName = m_filePrefix + "." + std::to_string(m_fileCount++) + ".pb";
+    m_output.WriteFile(fileName, std::string((const char *)profile.Data(), profile.Size()), false);
+
+    m_counts.clear();
+    m_windowStart = 0;
+}
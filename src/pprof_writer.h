@@ -0,0 +1,105 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "sample_writer.h"
+#include "protobuf_encoder.h"
+
+// Writes uncompressed profile.proto files that pprof and friends can read directly. Samples
+// are aggregated per (stack, thread) over a collection window. The first tick to finish after
+// the window is over encodes the whole profile, and the background writer's thread writes it
+// to <prefix>.<n>.pb. Every file stands on its own, the string/function/location tables are
+// rebuilt for each one.
+//
+// Each sample has two values, the number of samples and the time they represent (sum of the
+// sample weights * sampling interval). That time is wall or CPU time depending on the clock
+// the sampler runs on, timeType names it.
+class PprofSampleWriter : public SampleWriter
+{
+private:
+    struct SampleKey
+    {
+        uint32_t stackId;
+        ThreadID threadID;
+
+        bool operator==(const SampleKey &other) const
+        {
+            return stackId == other.stackId && threadID == other.threadID;
+        }
+    };
+
+    struct SampleKeyHash
+    {
+        size_t operator()(const SampleKey &key) const
+        {
+            size_t hash = std::hash<uintptr_t>()((uintptr_t)key.threadID);
+            hash ^= std::hash<uint32_t>()(key.stackId) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+            return hash;
+        }
+    };
+
+    struct SampleTotals
+    {
+        uint64_t count;
+        uint64_t weight;
+    };
+
+    // A loaded native image, found by dladdr the first time one of its frames shows up
+    struct NativeMapping
+    {
+        uint64_t baseAddress;
+        uint32_t fileNameId;
+    };
+
+    std::string m_filePrefix;
+    uint32_t m_fileCount;
+    uint64_t m_windowNs;
+    uint64_t m_samplingIntervalNs;
+    const char *m_timeType;
+
+    // Steady timestamp of the first sample in the window, 0 if the window is empty
+    uint64_t m_windowStart;
+    uint64_t m_windowStartWallNs;
+    std::unordered_map<SampleKey, SampleTotals, SampleKeyHash> m_counts;
+
+    // Frames are stable so the native mappings are kept across windows
+    std::vector<NativeMapping> m_nativeMappings;
+    std::unordered_map<uint64_t, uint32_t> m_mappingsByBase;
+    std::unordered_map<uint32_t, uint32_t> m_frameMappings;
+
+    // Per profile, maps symbol cache string IDs to string_table indexes
+    std::unordered_map<uint32_t, uint64_t> m_stringIndexes;
+    std::vector<uint32_t> m_stringTable;
+
+    uint64_t GetStringIndex(uint32_t stringId);
+    uint64_t GetStringIndex(const char *str)
+    {
+        return GetStringIndex(m_symbolCache.InternString(str));
+    }
+
+    // Returns the profile.proto mapping ID for a frame, 0 if it has none
+    uint32_t GetMappingId(uint32_t frameId, const Frame &frame);
+
+    void EncodeValueType(ProtobufEncoder &profile, uint32_t field, const char *type, const char *unit);
+    void WriteProfile(uint64_t endTimestamp);
+
+public:
+    PprofSampleWriter(BackgroundWriter &output,
+                      SymbolCache &symbolCache,
+                      StackTrie &stackTrie,
+                      const std::string &filePrefix,
+                      uint64_t windowNs,
+                      uint64_t samplingIntervalNs,
+                      const char *timeType);
+    virtual ~PprofSampleWriter() = default;
+
+    virtual void WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight);
+    virtual void TickFinished(uint64_t timestamp);
+    virtual void Finish(uint64_t timestamp);
+};
@@ -0,0 +1,115 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Just enough of the protobuf wire format to write messages, so we don't have to pull in
+// libprotobuf. Only varint and length delimited fields are supported, which is all that
+// profile.proto uses. Nested messages are encoded in to their own ProtobufEncoder and then
+// appended with WriteMessage.
+class ProtobufEncoder
+{
+private:
+    enum WireType : uint32_t
+    {
+        Varint = 0,
+        LengthDelimited = 2
+    };
+
+    std::vector<uint8_t> m_buffer;
+
+    void WriteRawVarint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            m_buffer.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+
+        m_buffer.push_back((uint8_t)value);
+    }
+
+    void WriteTag(uint32_t field, WireType type)
+    {
+        WriteRawVarint(((uint64_t)field << 3) | type);
+    }
+
+public:
+    ProtobufEncoder() :
+        m_buffer()
+    {
+
+    }
+
+    ~ProtobufEncoder() = default;
+
+    // Fields equal to the default (0) are left out, same as a real protobuf serializer
+    void WriteVarint(uint32_t field, uint64_t value)
+    {
+        if (value != 0)
+        {
+            WriteTag(field, Varint);
+            WriteRawVarint(value);
+        }
+    }
+
+    void WriteBool(uint32_t field, bool value)
+    {
+        WriteVarint(field, value ? 1 : 0);
+    }
+
+    // Repeated string fields have to keep empty entries, so this always writes
+    void WriteBytes(uint32_t field, const void *data, size_t size)
+    {
+        WriteTag(field, LengthDelimited);
+        WriteRawVarint(size);
+        m_buffer.insert(m_buffer.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+    }
+
+    void WriteString(uint32_t field, const std::string &str)
+    {
+        WriteBytes(field, str.data(), str.size());
+    }
+
+    void WriteMessage(uint32_t field, const ProtobufEncoder &message)
+    {
+        WriteBytes(field, message.Data(), message.Size());
+    }
+
+    // Packed encoding of a repeated integer field
+    void WritePackedVarints(uint32_t field, const std::vector<uint64_t> &values)
+    {
+        if (values.empty())
+        {
+            return;
+        }
+
+        ProtobufEncoder packed;
+        for (uint64_t value : values)
+        {
+            packed.WriteRawVarint(value);
+        }
+
+        WriteMessage(field, packed);
+    }
+
+    void Clear()
+    {
+        m_buffer.clear();
+    }
+
+    const uint8_t *Data() const
+    {
+        return m_buffer.data();
+    }
+
+    size_t Size() const
+    {
+        return m_buffer.size();
+    }
+};
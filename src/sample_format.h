@@ -0,0 +1,119 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "stack_trie.h"
+
+// Binary sample file layout. This header is shared by the profiler and the standalone reader,
+// so it must not depend on any runtime headers.
+//
+//      header  := magic[4] version:varint
+//      record  := type:byte fields...
+//
+//      String  := id:varint length:varint bytes[length]
+//      Frame   := id:varint kind:byte nameId:varint address:varint offset:varint
+//      Stack   := id:varint parent:varint frameId:varint
+//      Sample  := timestampDelta:varint threadId:varint stackId:varint weight:varint
+//
+// Every string, frame and stack is written once, before the first record that refers to it.
+// Stack IDs are trie node IDs and 0 is the empty stack, which is never written. Sample
+// timestamps are nanoseconds, each one relative to the previous sample in the file (the first
+// relative to 0). The weight is the number of sampling intervals the sample stands for.
+//
+// Readers must reject versions newer than the one they were built with.
+//
+// Version history:
+//      1   initial format
+//      2   added the sample weight, version 1 samples have a weight of 1
+
+static constexpr char SampleFileMagic[4] = { 'S', 'S', 'P', 'B' };
+static constexpr uint32_t SampleFileVersion = 2;
+
+enum class SampleRecordType : uint8_t
+{
+    String = 1,
+    Frame = 2,
+    Stack = 3,
+    Sample = 4
+};
+
+inline void AppendVarint(std::vector<uint8_t> &buffer, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+
+    buffer.push_back((uint8_t)value);
+}
+
+// Returns false if the varint runs past end or is longer than 64 bits
+inline bool ReadVarint(const uint8_t *&cursor, const uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7)
+    {
+        if (cursor >= end)
+        {
+            return false;
+        }
+
+        uint8_t byte = *cursor++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+inline void AppendSampleFileHeader(std::vector<uint8_t> &buffer)
+{
+    buffer.insert(buffer.end(), SampleFileMagic, SampleFileMagic + sizeof(SampleFileMagic));
+    AppendVarint(buffer, SampleFileVersion);
+}
+
+inline void AppendStringRecord(std::vector<uint8_t> &buffer, uint32_t id, const std::string &str)
+{
+    buffer.push_back((uint8_t)SampleRecordType::String);
+    AppendVarint(buffer, id);
+    AppendVarint(buffer, str.size());
+    buffer.insert(buffer.end(), str.begin(), str.end());
+}
+
+inline void AppendFrameRecord(std::vector<uint8_t> &buffer, uint32_t id, const Frame &frame)
+{
+    buffer.push_back((uint8_t)SampleRecordType::Frame);
+    AppendVarint(buffer, id);
+    buffer.push_back((uint8_t)frame.kind);
+    AppendVarint(buffer, frame.nameId);
+    AppendVarint(buffer, frame.address);
+    AppendVarint(buffer, frame.offset);
+}
+
+inline void AppendStackRecord(std::vector<uint8_t> &buffer, uint32_t id, const StackNode &node)
+{
+    buffer.push_back((uint8_t)SampleRecordType::Stack);
+    AppendVarint(buffer, id);
+    AppendVarint(buffer, node.parent);
+    AppendVarint(buffer, node.frameId);
+}
+
+inline void AppendSampleRecord(std::vector<uint8_t> &buffer, uint64_t timestampDelta, uint64_t threadId, uint32_t stackId, uint32_t weight)
+{
+    buffer.push_back((uint8_t)SampleRecordType::Sample);
+    AppendVarint(buffer, timestampDelta);
+    AppendVarint(buffer, threadId);
+    AppendVarint(buffer, stackId);
+    AppendVarint(buffer, weight);
+}
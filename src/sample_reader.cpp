@@ -0,0 +1,238 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <cstdio>
+#include <cstring>
+
+#include "sample_reader.h"
+
+using std::string;
+
+SampleReader::SampleReader() :
+    m_data(),
+    m_cursor(nullptr),
+    m_end(nullptr),
+    m_version(0),
+    m_lastTimestamp(0),
+    m_error(),
+    m_strings(),
+    m_frames(),
+    m_stacks(1),
+    m_definedStrings(),
+    m_definedFrames(),
+    m_definedStacks(1, true)
+{
+    // Stack 0 is the root and is never written to the file
+    m_stacks[StackTrie::RootStackId] = StackNode { StackTrie::InvalidId, StackTrie::InvalidId };
+}
+
+bool SampleReader::Fail(const char *message)
+{
+    m_error = message;
+    m_cursor = m_end;
+    return false;
+}
+
+bool SampleReader::Open(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        return Fail("Unable to open file");
+    }
+
+    uint8_t buffer[64 * 1024];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        m_data.insert(m_data.end(), buffer, buffer + read);
+    }
+
+    fclose(file);
+
+    m_cursor = m_data.data();
+    m_end = m_data.data() + m_data.size();
+
+    if (m_data.size() < sizeof(SampleFileMagic) || memcmp(m_cursor, SampleFileMagic, sizeof(SampleFileMagic)) != 0)
+    {
+        return Fail("Not a sample file");
+    }
+
+    m_cursor += sizeof(SampleFileMagic);
+
+    if (!ReadVarint(m_cursor, m_end, &m_version))
+    {
+        return Fail("Truncated header");
+    }
+
+    if (m_version == 0 || m_version > SampleFileVersion)
+    {
+        return Fail("Unsupported sample file version");
+    }
+
+    return true;
+}
+
+bool SampleReader::ReadId(uint32_t *id)
+{
+    uint64_t value;
+    if (!ReadVarint(m_cursor, m_end, &value) || value >= StackTrie::InvalidId)
+    {
+        return false;
+    }
+
+    *id = (uint32_t)value;
+    return true;
+}
+
+bool SampleReader::ReadStringRecord()
+{
+    uint32_t id;
+    uint64_t length;
+    if (!ReadId(&id) || !ReadVarint(m_cursor, m_end, &length) || length > (uint64_t)(m_end - m_cursor))
+    {
+        return Fail("Malformed string record");
+    }
+
+    if (id >= m_strings.size())
+    {
+        m_strings.resize(id + 1);
+        m_definedStrings.resize(id + 1, false);
+    }
+
+    m_strings[id] = string((const char *)m_cursor, (size_t)length);
+    m_definedStrings[id] = true;
+    m_cursor += length;
+    return true;
+}
+
+bool SampleReader::ReadFrameRecord()
+{
+    uint32_t id;
+    Frame frame;
+    uint64_t address;
+    uint64_t offset;
+    if (!ReadId(&id) || m_cursor >= m_end)
+    {
+        return Fail("Malformed frame record");
+    }
+
+    frame.kind = (FrameKind)*m_cursor++;
+    if (!ReadId(&frame.nameId) || !ReadVarint(m_cursor, m_end, &address) || !ReadVarint(m_cursor, m_end, &offset))
+    {
+        return Fail("Malformed frame record");
+    }
+
+    if (frame.nameId >= m_definedStrings.size() || !m_definedStrings[frame.nameId])
+    {
+        return Fail("Frame refers to an undefined string");
+    }
+
+    frame.address = address;
+    frame.offset = offset;
+
+    if (id >= m_frames.size())
+    {
+        m_frames.resize(id + 1);
+        m_definedFrames.resize(id + 1, false);
+    }
+
+    m_frames[id] = frame;
+    m_definedFrames[id] = true;
+    return true;
+}
+
+bool SampleReader::ReadStackRecord()
+{
+    uint32_t id;
+    StackNode node;
+    if (!ReadId(&id) || !ReadId(&node.parent) || !ReadId(&node.frameId) || id == StackTrie::RootStackId)
+    {
+        return Fail("Malformed stack record");
+    }
+
+    if (node.parent >= m_definedStacks.size() || !m_definedStacks[node.parent])
+    {
+        return Fail("Stack refers to an undefined parent");
+    }
+
+    if (node.frameId >= m_definedFrames.size() || !m_definedFrames[node.frameId])
+    {
+        return Fail("Stack refers to an undefined frame");
+    }
+
+    if (id >= m_stacks.size())
+    {
+        m_stacks.resize(id + 1);
+        m_definedStacks.resize(id + 1, false);
+    }
+
+    m_stacks[id] = node;
+    m_definedStacks[id] = true;
+    return true;
+}
+
+bool SampleReader::ReadSample(SampleRecord *sample)
+{
+    while (m_cursor < m_end)
+    {
+        SampleRecordType type = (SampleRecordType)*m_cursor++;
+        switch (type)
+        {
+            case SampleRecordType::String:
+                if (!ReadStringRecord())
+                {
+                    return false;
+                }
+                break;
+
+            case SampleRecordType::Frame:
+                if (!ReadFrameRecord())
+                {
+                    return false;
+                }
+                break;
+
+            case SampleRecordType::Stack:
+                if (!ReadStackRecord())
+                {
+                    return false;
+                }
+                break;
+
+            case SampleRecordType::Sample:
+            {
+                uint64_t delta;
+                uint32_t stackId;
+                if (!ReadVarint(m_cursor, m_end, &delta)
+                    || !ReadVarint(m_cursor, m_end, &sample->threadId)
+                    || !ReadId(&stackId))
+                {
+                    return Fail("Malformed sample record");
+                }
+
+                sample->weight = 1;
+                if (m_version >= 2 && !ReadVarint(m_cursor, m_end, &sample->weight))
+                {
+                    return Fail("Malformed sample record");
+                }
+
+                if (stackId >= m_definedStacks.size() || !m_definedStacks[stackId])
+                {
+                    return Fail("Sample refers to an undefined stack");
+                }
+
+                m_lastTimestamp += delta;
+                sample->timestamp = m_lastTimestamp;
+                sample->stackId = stackId;
+                return true;
+            }
+
+            default:
+                return Fail("Unknown record type");
+        }
+    }
+
+    return false;
+}
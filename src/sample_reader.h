@@ -0,0 +1,77 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sample_format.h"
+
+struct SampleRecord
+{
+    // Absolute nanoseconds, the deltas in the file are already added up
+    uint64_t timestamp;
+    uint64_t threadId;
+    uint32_t stackId;
+    // Number of sampling intervals this sample stands for
+    uint64_t weight;
+};
+
+// Reads the files BinarySampleWriter produces. String, frame and stack definitions are
+// collected as they go by, so by the time ReadSample returns a sample everything it refers to
+// can be looked up.
+class SampleReader
+{
+private:
+    std::vector<uint8_t> m_data;
+    const uint8_t *m_cursor;
+    const uint8_t *m_end;
+    uint64_t m_version;
+    uint64_t m_lastTimestamp;
+    std::string m_error;
+
+    std::vector<std::string> m_strings;
+    std::vector<Frame> m_frames;
+    std::vector<StackNode> m_stacks;
+    std::vector<bool> m_definedStrings;
+    std::vector<bool> m_definedFrames;
+    std::vector<bool> m_definedStacks;
+
+    bool Fail(const char *message);
+    bool ReadId(uint32_t *id);
+    bool ReadStringRecord();
+    bool ReadFrameRecord();
+    bool ReadStackRecord();
+
+public:
+    SampleReader();
+    ~SampleReader() = default;
+
+    bool Open(const char *path);
+
+    // Returns false at the end of the file or on a malformed file, GetError tells them apart
+    bool ReadSample(SampleRecord *sample);
+
+    const std::string &GetError() const
+    {
+        return m_error;
+    }
+
+    const std::string &GetString(uint32_t id) const
+    {
+        return m_strings[id];
+    }
+
+    const Frame &GetFrame(uint32_t id) const
+    {
+        return m_frames[id];
+    }
+
+    const StackNode &GetStack(uint32_t id) const
+    {
+        return m_stacks[id];
+    }
+};
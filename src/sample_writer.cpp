@@ -0,0 +1,267 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <cstdarg>
+#include <cinttypes>
+#include <algorithm>
+
+#include "CorProfiler.h"
+#include "sample_writer.h"
+#include "sample_format.h"
+
+using std::string;
+
+static void AppendFormat(string &record, const char *format, ...)
+{
+    char buffer[LONG_LENGTH];
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (length < 0)
+    {
+        return;
+    }
+
+    if ((size_t)length < sizeof(buffer))
+    {
+        record.append(buffer, length);
+        return;
+    }
+
+    // Long generic names can overflow the stack buffer
+    size_t offset = record.size();
+    record.resize(offset + length + 1);
+    va_start(args, format);
+    vsnprintf(&record[offset], length + 1, format, args);
+    va_end(args);
+    record.resize(offset + length);
+}
+
+void TextSampleWriter::WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight)
+{
+    m_record.clear();
+    AppendFormat(m_record, "Starting stack walk for managed thread id=0x%" PRIx64 "\n", (uint64_t)threadID);
+
+    // Following the parent links goes from the leaf to the root, which is the order the
+    // stack walks have always printed in.
+    while (stackId != StackTrie::RootStackId)
+    {
+        const StackNode &node = m_stackTrie.GetNode(stackId);
+        const Frame &frame = m_stackTrie.GetFrame(node.frameId);
+        const string &name = m_symbolCache.GetString(frame.nameId);
+
+        if (frame.kind == FrameKind::Managed)
+        {
+            AppendFormat(m_record, "    %s (funcId=0x%" PRIx64 ")\n", name.c_str(), frame.address);
+        }
+        else
+        {
+            AppendFormat(m_record, "    Native frame \"%s+0x%" PRIx64 "\" ip=%" PRIx64 "\n", name.c_str(), frame.offset, frame.address);
+        }
+
+        stackId = node.parent;
+    }
+
+    AppendFormat(m_record, "Ending stack walk for managed thread id=0x%" PRIx64 "\n", (uint64_t)threadID);
+    m_output.Append(m_record.data(), m_record.size());
+}
+
+void StackSampleWriter::WriteFrame(uint32_t frameId)
+{
+    if (!MarkWritten(m_writtenFrames, frameId, m_newFrames))
+    {
+        return;
+    }
+
+    const Frame &frame = m_stackTrie.GetFrame(frameId);
+    const string &name = m_symbolCache.GetString(frame.nameId);
+    if (frame.kind == FrameKind::Managed)
+    {
+        AppendFormat(m_record, "frame %u managed 0x%" PRIx64 " %s\n", frameId, frame.address, name.c_str());
+    }
+    else
+    {
+        AppendFormat(m_record, "frame %u native 0x%" PRIx64 " %s+0x%" PRIx64 "\n", frameId, frame.address, name.c_str(), frame.offset);
+    }
+}
+
+void StackSampleWriter::WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight)
+{
+    m_record.clear();
+    m_newFrames.clear();
+    m_newStacks.clear();
+
+    WriteNewStacks(stackId, m_writtenStacks, m_newStacks, [this](uint32_t id, const StackNode &node)
+    {
+        WriteFrame(node.frameId);
+        AppendFormat(m_record, "stack %u %u %u\n", id, node.parent, node.frameId);
+    });
+
+    AppendFormat(m_record, "sample %" PRIu64 " 0x%" PRIx64 " %u %u\n", timestamp, (uint64_t)threadID, stackId, weight);
+
+    if (!m_output.Append(m_record.data(), m_record.size()))
+    {
+        UnmarkWritten(m_writtenFrames, m_newFrames);
+        UnmarkWritten(m_writtenStacks, m_newStacks);
+    }
+}
+
+BinarySampleWriter::BinarySampleWriter(BackgroundWriter &output, SymbolCache &symbolCache, StackTrie &stackTrie) :
+    SampleWriter(output, symbolCache, stackTrie),
+    m_buffer(),
+    m_writtenStrings(),
+    m_writtenFrames(),
+    m_writtenStacks(),
+    m_newStrings(),
+    m_newFrames(),
+    m_newStacks(),
+    m_lastTimestamp(0)
+{
+    // Nothing else has been appended yet so this can't be dropped
+    AppendSampleFileHeader(m_buffer);
+    m_output.Append(m_buffer.data(), m_buffer.size());
+}
+
+void BinarySampleWriter::WriteString(uint32_t stringId)
+{
+    if (MarkWritten(m_writtenStrings, stringId, m_newStrings))
+    {
+        AppendStringRecord(m_buffer, stringId, m_symbolCache.GetString(stringId));
+    }
+}
+
+void BinarySampleWriter::WriteFrame(uint32_t frameId)
+{
+    if (!MarkWritten(m_writtenFrames, frameId, m_newFrames))
+    {
+        return;
+    }
+
+    const Frame &frame = m_stackTrie.GetFrame(frameId);
+    WriteString(frame.nameId);
+    AppendFrameRecord(m_buffer, frameId, frame);
+}
+
+void BinarySampleWriter::WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight)
+{
+    m_buffer.clear();
+    m_newStrings.clear();
+    m_newFrames.clear();
+    m_newStacks.clear();
+
+    WriteNewStacks(stackId, m_writtenStacks, m_newStacks, [this](uint32_t id, const StackNode &node)
+    {
+        WriteFrame(node.frameId);
+        AppendStackRecord(m_buffer, id, node);
+    });
+
+    // Samples come from one thread in timestamp order, guard against the clock anyway since
+    // the delta is unsigned
+    uint64_t delta = timestamp >= m_lastTimestamp ? timestamp - m_lastTimestamp : 0;
+    AppendSampleRecord(m_buffer, delta, (uint64_t)threadID, stackId, weight);
+
+    if (m_output.Append(m_buffer.data(), m_buffer.size()))
+    {
+        m_lastTimestamp += delta;
+    }
+    else
+    {
+        UnmarkWritten(m_writtenStrings, m_newStrings);
+        UnmarkWritten(m_writtenFrames, m_newFrames);
+        UnmarkWritten(m_writtenStacks, m_newStacks);
+    }
+}
+
+FoldedSampleWriter::FoldedSampleWriter(BackgroundWriter &output,
+                                       SymbolCache &symbolCache,
+                                       StackTrie &stackTrie,
+                                       const std::string &fileName,
+                                       uint64_t writeIntervalNs) :
+    SampleWriter(output, symbolCache, stackTrie),
+    m_fileName(fileName),
+    m_writeIntervalNs(writeIntervalNs),
+    m_lastWrite(GetTimestamp()),
+    m_dirty(false),
+    m_counts(),
+    m_sampledStacks(),
+    m_contents(),
+    m_nameIds()
+{
+
+}
+
+void FoldedSampleWriter::WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight)
+{
+    if (stackId >= m_counts.size())
+    {
+        m_counts.resize(stackId + 1, 0);
+    }
+
+    if (m_counts[stackId] == 0)
+    {
+        m_sampledStacks.push_back(stackId);
+    }
+
+    m_counts[stackId] += weight;
+
+    m_dirty = true;
+}
+
+void FoldedSampleWriter::TickFinished(uint64_t timestamp)
+{
+    if (timestamp - m_lastWrite >= m_writeIntervalNs)
+    {
+        WriteFile();
+        m_lastWrite = timestamp;
+    }
+}
+
+void FoldedSampleWriter::Finish(uint64_t timestamp)
+{
+    // Whatever came in since the last write, or everything if the run was shorter than the interval
+    WriteFile();
+    m_lastWrite = timestamp;
+}
+
+void FoldedSampleWriter::WriteFile()
+{
+    if (!m_dirty)
+    {
+        return;
+    }
+
+    m_contents.clear();
+    for (uint32_t stackId : m_sampledStacks)
+    {
+        // The parent links go from the leaf up, folded lines start at the root
+        m_nameIds.clear();
+        for (uint32_t id = stackId; id != StackTrie::RootStackId; id = m_stackTrie.GetNode(id).parent)
+        {
+            m_nameIds.push_back(m_stackTrie.GetFrame(m_stackTrie.GetNode(id).frameId).nameId);
+        }
+
+        for (auto it = m_nameIds.rbegin(); it != m_nameIds.rend(); ++it)
+        {
+            if (it != m_nameIds.rbegin())
+            {
+                m_contents.push_back(';');
+            }
+
+            // ';' separates frames, so it can't appear inside one
+            size_t start = m_contents.size();
+            m_contents.append(m_symbolCache.GetString(*it));
+            std::replace(m_contents.begin() + start, m_contents.end(), ';', ':');
+        }
+
+        AppendFormat(m_contents, " %" PRIu64 "\n", m_counts[stackId]);
+    }
+
+    // Written next to the old file and renamed over it, so anything reading the file never
+    // sees half of an update. The copy keeps m_contents' capacity for the next time.
+    m_output.WriteFile(m_fileName, m_contents, true);
+    m_dirty = false;
+}
@@ -0,0 +1,222 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "symbol_cache.h"
+#include "stack_trie.h"
+#include "background_writer.h"
+
+// Receives every sample once the sampler has turned it in to a stack ID. Implementations
+// decide what ends up on disk, they can get at the frames and names through the trie and
+// the symbol cache. Each sample is handed to the BackgroundWriter as a single record, so if
+// it has to be dropped nothing it depends on is lost with it.
+class SampleWriter
+{
+private:
+    std::vector<uint32_t> m_missingStacks;
+
+protected:
+    BackgroundWriter &m_output;
+    SymbolCache &m_symbolCache;
+    StackTrie &m_stackTrie;
+
+    // For formats that define each stack node once. Parents have to be defined before their
+    // children, so this walks up from stackId to the first node already in writtenStacks and
+    // then calls writeNode(id, node) for the missing ones on the way back down, root first.
+    // The nodes are marked written, writeNode emits the node's record and anything it needs.
+    template<class WriteNode>
+    void WriteNewStacks(uint32_t stackId, std::vector<bool> &writtenStacks, std::vector<uint32_t> &newStacks, WriteNode writeNode)
+    {
+        m_missingStacks.clear();
+        while (stackId != StackTrie::RootStackId
+                && (stackId >= writtenStacks.size() || !writtenStacks[stackId]))
+        {
+            m_missingStacks.push_back(stackId);
+            stackId = m_stackTrie.GetNode(stackId).parent;
+        }
+
+        for (auto it = m_missingStacks.rbegin(); it != m_missingStacks.rend(); ++it)
+        {
+            uint32_t id = *it;
+            MarkWritten(writtenStacks, id, newStacks);
+            writeNode(id, m_stackTrie.GetNode(id));
+        }
+    }
+
+public:
+    SampleWriter(BackgroundWriter &output, SymbolCache &symbolCache, StackTrie &stackTrie) :
+        m_missingStacks(),
+        m_output(output),
+        m_symbolCache(symbolCache),
+        m_stackTrie(stackTrie)
+    {
+
+    }
+
+    virtual ~SampleWriter() = default;
+
+    // Returns true the first time it is called for a given id, and remembers the id in
+    // newIds so the mark can be rolled back if the record it went in to gets dropped
+    static bool MarkWritten(std::vector<bool> &written, uint32_t id, std::vector<uint32_t> &newIds)
+    {
+        if (id >= written.size())
+        {
+            written.resize(id + 1, false);
+        }
+
+        if (written[id])
+        {
+            return false;
+        }
+
+        written[id] = true;
+        newIds.push_back(id);
+        return true;
+    }
+
+    // Marks made while building a record that then gets dropped have to be undone
+    static void UnmarkWritten(std::vector<bool> &written, const std::vector<uint32_t> &ids)
+    {
+        for (uint32_t id : ids)
+        {
+            written[id] = false;
+        }
+    }
+
+    // weight is the number of sampling intervals the sample stands for. It is 1 unless the
+    // sampler fell behind and missed ticks, those intervals are charged to the next samples.
+    virtual void WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight) = 0;
+
+    // Called at the end of every tick, never at the same time as WriteSample. Formats that
+    // write on a schedule do it from here, so output keeps coming when samples don't.
+    virtual void TickFinished(uint64_t timestamp)
+    {
+
+    }
+
+    // Called once at shutdown after the last sample has been written. Formats that hold on to
+    // samples between writes hand whatever they have to the background writer here.
+    virtual void Finish(uint64_t timestamp)
+    {
+
+    }
+};
+
+// The original output, every frame of every sample on its own line. It has no room for
+// weights, use one of the other formats when sampling at a rate the sampler can't sustain.
+class TextSampleWriter : public SampleWriter
+{
+private:
+    std::string m_record;
+
+public:
+    TextSampleWriter(BackgroundWriter &output, SymbolCache &symbolCache, StackTrie &stackTrie) :
+        SampleWriter(output, symbolCache, stackTrie),
+        m_record()
+    {
+
+    }
+
+    virtual ~TextSampleWriter() = default;
+
+    virtual void WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight);
+};
+
+// Deduplicated text output. Frames and stack nodes are written once, the first time a sample
+// uses them, after that a sample is a single line:
+//
+//      frame <frameId> managed <funcId> <name>
+//      frame <frameId> native <ip> <name>+<offset>
+//      stack <stackId> <parentStackId> <frameId>
+//      sample <timestamp> <threadId> <stackId> <weight>
+class StackSampleWriter : public SampleWriter
+{
+private:
+    std::string m_record;
+    std::vector<bool> m_writtenFrames;
+    std::vector<bool> m_writtenStacks;
+    std::vector<uint32_t> m_newFrames;
+    std::vector<uint32_t> m_newStacks;
+
+    void WriteFrame(uint32_t frameId);
+
+public:
+    StackSampleWriter(BackgroundWriter &output, SymbolCache &symbolCache, StackTrie &stackTrie) :
+        SampleWriter(output, symbolCache, stackTrie),
+        m_record(),
+        m_writtenFrames(),
+        m_writtenStacks(),
+        m_newFrames(),
+        m_newStacks()
+    {
+
+    }
+
+    virtual ~StackSampleWriter() = default;
+
+    virtual void WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight);
+};
+
+// Compact binary output, see sample_format.h for the layout
+class BinarySampleWriter : public SampleWriter
+{
+private:
+    std::vector<uint8_t> m_buffer;
+    std::vector<bool> m_writtenStrings;
+    std::vector<bool> m_writtenFrames;
+    std::vector<bool> m_writtenStacks;
+    std::vector<uint32_t> m_newStrings;
+    std::vector<uint32_t> m_newFrames;
+    std::vector<uint32_t> m_newStacks;
+    uint64_t m_lastTimestamp;
+
+    void WriteString(uint32_t stringId);
+    void WriteFrame(uint32_t frameId);
+
+public:
+    BinarySampleWriter(BackgroundWriter &output, SymbolCache &symbolCache, StackTrie &stackTrie);
+    virtual ~BinarySampleWriter() = default;
+
+    virtual void WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight);
+};
+
+// Collapsed stacks for flame graphs, one "root;...;leaf count" line per distinct stack, where
+// count is the sum of the sample weights. Samples only bump a counter for their stack ID, so memory grows with the number of distinct stacks
+// rather than the number of samples. Every writeIntervalNs (and once more at shutdown), if
+// anything changed, the running totals are formatted in memory and the background writer's
+// thread replaces the file with them. Nothing on the sampling path touches the disk.
+class FoldedSampleWriter : public SampleWriter
+{
+private:
+    std::string m_fileName;
+    uint64_t m_writeIntervalNs;
+    uint64_t m_lastWrite;
+    bool m_dirty;
+
+    // Indexed by stack ID, m_sampledStacks lists the IDs with a non zero count
+    std::vector<uint64_t> m_counts;
+    std::vector<uint32_t> m_sampledStacks;
+
+    std::string m_contents;
+    std::vector<uint32_t> m_nameIds;
+
+    void WriteFile();
+
+public:
+    FoldedSampleWriter(BackgroundWriter &output,
+                       SymbolCache &symbolCache,
+                       StackTrie &stackTrie,
+                       const std::string &fileName,
+                       uint64_t writeIntervalNs);
+    virtual ~FoldedSampleWriter() = default;
+
+    virtual void WriteSample(uint64_t timestamp, ThreadID threadID, uint32_t stackId, uint32_t weight);
+    virtual void TickFinished(uint64_t timestamp);
+    virtual void Finish(uint64_t timestamp);
+};
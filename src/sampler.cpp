@@ -5,316 +5,536 @@
 #include <thread>
 #include <cstdio>
 #include <cinttypes>
+#include <algorithm>
 
 #include "CorProfiler.h"
 #include "sampler.h"
 
 ManualEvent Sampler::s_waitEvent;
 
-WSTRING Sampler::GetModuleName(ModuleID modId)
+// static
+void Sampler::DoSampling(Sampler *sampler, ICorProfilerInfo10 *pProfInfo, CorProfiler *parent, FILE *outputFile)
 {
-    WCHAR moduleFullName[STRING_LENGTH];
-    ULONG nameLength = 0;
-    AssemblyID assemID;
+    pProfInfo->InitializeCurrentThread();
 
-    if (modId == NULL)
+    uint64_t interval = sampler->m_samplingIntervalNs;
+    uint32_t multiplier = 1;
+    uint64_t deadline = GetTimestamp() + interval;
+    while (!sampler->m_shutdown.load())
     {
-        fprintf(m_outputFile, "NULL modId passed to GetModuleName\n");
-        return WSTR("Unknown");
-    }
+        SleepUntil(deadline);
 
-    HRESULT hr = m_pCorProfilerInfo->GetModuleInfo(modId,
-                                                NULL,
-                                                STRING_LENGTH,
-                                                &nameLength,
-                                                moduleFullName,
-                                                &assemID);
-    if (FAILED(hr))
-    {
-        fprintf(m_outputFile, "GetModuleInfo failed with hr=0x%x\n", hr);
-        return WSTR("Unknown");
-    }
+        uint64_t waitStart = GetTimestamp();
+        s_waitEvent.Wait();
+        uint64_t now = GetTimestamp();
 
-    WCHAR *ptr = NULL;
-    WCHAR *index = moduleFullName;
-    // Find the last occurence of the \ character
-    while (*index != 0)
-    {
-        if (*index == '\\' || *index == '/')
+        if (sampler->m_shutdown.load())
         {
-            ptr = index;
+            break;
         }
 
-        ++index;
-    }
+        if (now - waitStart >= interval)
+        {
+            // Sampling was stopped for a while, that's not the sampler falling behind so
+            // start a new schedule instead of counting missed ticks
+            deadline = now + interval;
+            sampler->m_tickWeight = multiplier;
+        }
+        else
+        {
+            // Every whole interval we are past the deadline is a tick that never happened,
+            // charge that time to this tick's samples rather than losing it
+            uint64_t missed = now > deadline ? (now - deadline) / interval : 0;
+            sampler->m_missedTicks.fetch_add(missed, std::memory_order_relaxed);
+            sampler->m_tickWeight = (uint32_t)std::min<uint64_t>((missed + 1) * multiplier, UINT32_MAX);
+            deadline += (missed + 1) * interval;
+        }
 
-    if (ptr == NULL)
-    {
-        return moduleFullName;
-    }
-    // Skip the last \ in the string
-    ++ptr;
+        sampler->m_ticks.fetch_add(1, std::memory_order_relaxed);
 
-    WSTRING moduleName;
-    while (*ptr != 0)
-    {
-        moduleName += *ptr;
-        ++ptr;
-    }
+        // This is a hack that was convenient for writing this profiler.
+        // It checks if any methods have been jitted yet, but the runtime
+        // can execute managed code from ready to run images without jitting
+        // any code so it won't always work correctly.
+        //
+        // It also isn't strictly necessary to check this, you can suspend the
+        // runtime at any point but for this profiler we don't care until there
+        // are managed callstacks to sample.
+        if (!parent->IsRuntimeExecutingManagedCode())
+        {
+            fprintf(outputFile, "Runtime has not started executing managed code yet.\n");
+            continue;
+        }
 
-    return moduleName;
-}
+        uint64_t cpuStart = GetCurrentThreadCpuTime();
+        sampler->m_tickSuspendedNs = 0;
+        sampler->m_tickHandlerNs = 0;
+
+        // Once any processing left over from the last tick is finished nothing from it is
+        // still in use, so entries for threads destroyed and modules unloaded since then can be
+        // reused or released now
+        sampler->WaitForProcessing();
+        sampler->m_threadIDMap.Reclaim();
+        parent->ReclaimModuleMetadata();
+        if (sampler->m_nativeSymbolizer.Update())
+        {
+            sampler->m_unknownNativeFrameIds.clear();
+        }
 
+        if (sampler->m_frameIdsStale.exchange(false))
+        {
+            sampler->m_managedFrameIds.clear();
+            sampler->m_nativeFrameIds.clear();
+            sampler->m_unknownNativeFrameIds.clear();
+        }
 
-WSTRING Sampler::GetClassName(ClassID classId)
-{
-    ModuleID modId;
-    mdTypeDef classToken;
-    ClassID parentClassID;
-    ULONG32 nTypeArgs;
-    ClassID typeArgs[SHORT_LENGTH];
-    HRESULT hr = S_OK;
+        if (!sampler->BeforeSampleAllThreads())
+        {
+            continue;
+        }
 
-    if (classId == NULL)
-    {
-        fprintf(m_outputFile, "NULL classId passed to GetClassName\n");
-        return WSTR("Unknown");
+        ICorProfilerThreadEnum* threadEnum = nullptr;
+        HRESULT hr = pProfInfo->EnumThreads(&threadEnum);
+        if (FAILED(hr))
+        {
+            fprintf(outputFile, "Error getting thread enumerator\n");
+            continue;
+        }
+
+        ThreadID threadID;
+        ULONG numReturned;
+        while ((hr = threadEnum->Next(1, &threadID, &numReturned)) == S_OK)
+        {
+            sampler->SampleThread(threadID);
+        }
+
+        bool finished = sampler->AfterSampleAllThreads();
+
+        // Everything is running again, so this is where deferred samples get their names
+        sampler->FlushDeferredSamples();
+
+        {
+            // Workers could still be writing this tick's samples
+            std::lock_guard<std::mutex> lock(sampler->m_processingLock);
+            sampler->m_sampleWriter->TickFinished(GetTimestamp());
+        }
+
+        if (!sampler->m_reportedFullTables && (sampler->m_stackTrie.Full() || sampler->m_symbolCache.Full()))
+        {
+            fprintf(outputFile, "Ran out of frame, stack or name IDs, new ones will be recorded as Unknown or cut short\n");
+            sampler->m_reportedFullTables = true;
+        }
+
+        if (!finished)
+        {
+            continue;
+        }
+
+        if (sampler->m_governor.Enabled())
+        {
+            sampler->UpdateGovernor(GetCurrentThreadCpuTime() - cpuStart);
+            if (sampler->m_governor.Multiplier() != multiplier)
+            {
+                multiplier = sampler->m_governor.Multiplier();
+                interval = sampler->m_samplingIntervalNs * multiplier;
+                sampler->m_intervalMultiplier.store(multiplier);
+                sampler->SamplingIntervalChanged(interval);
+            }
+        }
     }
+}
 
-    hr = m_pCorProfilerInfo->GetClassIDInfo2(classId,
-                                &modId,
-                                &classToken,
-                                &parentClassID,
-                                SHORT_LENGTH,
-                                &nTypeArgs,
-                                typeArgs);
-    if (CORPROF_E_CLASSID_IS_ARRAY == hr)
+void Sampler::UpdateGovernor(uint64_t samplingCpuNs)
+{
+    uint64_t writeCpuNs = m_backgroundWriter->WriteCpuTime();
+
+    TickCost cost;
+    cost.suspendedNs = m_tickSuspendedNs;
+    cost.handlerNs = m_tickHandlerNs;
+    uint64_t processingCpuNs = m_processingCpuNs.load(std::memory_order_relaxed);
+    cost.samplingNs = samplingCpuNs + (processingCpuNs - m_lastProcessingCpuNs);
+    m_lastProcessingCpuNs = processingCpuNs;
+    cost.writingNs = writeCpuNs - m_lastWriteCpuNs;
+    m_lastWriteCpuNs = writeCpuNs;
+
+    uint32_t oldMultiplier = m_governor.Multiplier();
+    uint32_t multiplier = m_governor.Update(cost);
+    if (multiplier != oldMultiplier)
     {
-        // We have a ClassID of an array.
-        return WSTR("ArrayClass");
+        fprintf(m_outputFile, "Tick costs %.0fus on average (suspended=%" PRIu64 "us handlers=%" PRIu64 "us sampling=%" PRIu64 "us writing=%" PRIu64 "us), sampling every %" PRIu64 "ms\n",
+            m_governor.AverageCostNs() / 1000,
+            cost.suspendedNs / 1000,
+            cost.handlerNs / 1000,
+            cost.samplingNs / 1000,
+            cost.writingNs / 1000,
+            m_samplingIntervalNs * multiplier / 1000000);
     }
-    else if (CORPROF_E_CLASSID_IS_COMPOSITE == hr)
+}
+
+// static
+double Sampler::ReadOverheadBudget()
+{
+    std::string budgetSetting = ReadEnvironmentVariable("STACKSAMPLER_OVERHEAD_BUDGET");
+    if (budgetSetting == "")
     {
-        // We have a composite class
-        return WSTR("CompositeClass");
+        return 0;
     }
-    else if (CORPROF_E_DATAINCOMPLETE == hr)
+
+    // Percent of one core
+    double budget = strtod(budgetSetting.c_str(), nullptr) / 100;
+    if (budget <= 0)
     {
-        // type-loading is not yet complete. Cannot do anything about it.
-        return WSTR("DataIncomplete");
+        return 0;
     }
-    else if (FAILED(hr))
+
+    printf("Keeping sampling overhead under %.2f%% of one core\n", budget * 100);
+    return budget;
+}
+
+void Sampler::SamplingIntervalChanged(uint64_t intervalNs)
+{
+
+}
+
+void Sampler::WaitForProcessing()
+{
+
+}
+
+// static
+uint64_t Sampler::ReadSamplingInterval()
+{
+    uint64_t intervalMs = 100;
+    std::string intervalSetting = ReadEnvironmentVariable("STACKSAMPLER_INTERVAL_MS");
+    if (intervalSetting != "")
     {
-        fprintf(m_outputFile, "GetClassIDInfo returned hr=0x%x for classID=0x%" PRIx64 "\n", hr, (uint64_t)classId);
-        return WSTR("Unknown");
+        intervalMs = std::min<uint64_t>(1000, std::max<uint64_t>(1, strtoull(intervalSetting.c_str(), nullptr, 10)));
     }
 
-    IMetaDataImport *pMDImport = m_parent->GetMetadataForModule(modId);
-    if (pMDImport == NULL)
+    printf("Sampling every %" PRIu64 "ms\n", intervalMs);
+    return intervalMs * 1000 * 1000;
+}
+
+// static
+FILE *Sampler::OpenOutputFile()
+{
+    std::string fileName = std::tmpnam(nullptr) + std::string(".txt");
+    FILE *outputFile = fopen(fileName.c_str(), "w+");
+    printf("Writing sampler output to \"%s\"\n", fileName.c_str());
+    return outputFile;
+}
+
+Sampler::Sampler(ICorProfilerInfo10* pProfInfo, CorProfiler *parent, SampleClock sampleClock) :
+    m_workerThread(),
+    m_shutdown(false),
+    m_ticks(0),
+    m_missedTicks(0),
+    m_deferredSamples(),
+    m_deferredFrames(),
+    m_resolvedFrames(),
+    m_managedFrameIds(),
+    m_nativeFrameIds(),
+    m_unknownNativeFrameIds(),
+    m_frameIdsStale(false),
+    m_reportedFullTables(false),
+    m_processingLock(),
+    m_lastProcessingCpuNs(0),
+    m_pCorProfilerInfo(pProfInfo),
+    m_parent(parent),
+    m_outputFile(OpenOutputFile()),
+    m_threadIDMap(MaxThreads),
+    m_samplingIntervalNs(ReadSamplingInterval()),
+    m_sampleClock(sampleClock),
+    m_tickWeight(1),
+    m_intervalMultiplier(1),
+    m_tickSuspendedNs(0),
+    m_tickHandlerNs(0),
+    m_processingCpuNs(0),
+    // Never slower than once a second, unless that's what was asked for
+    m_governor(ReadOverheadBudget(), m_samplingIntervalNs, std::max<uint64_t>(m_samplingIntervalNs, 1000 * 1000 * 1000)),
+    m_lastWriteCpuNs(0),
+    m_symbolCache(pProfInfo, parent, m_outputFile),
+    m_nativeSymbolizer(m_outputFile),
+    m_stackTrie(),
+    m_sampleFile(m_outputFile),
+    m_backgroundWriter(),
+    m_sampleWriter(),
+    m_deferSymbols(ReadEnvironmentVariable("STACKSAMPLER_DEFER_SYMBOLS") != ""),
+    m_threadStateReader(m_outputFile)
+{
+    // The first frame is what new frames turn in to if the trie ever runs out of frame IDs
+    Frame unknownFrame;
+    unknownFrame.kind = FrameKind::Native;
+    unknownFrame.nameId = m_symbolCache.InternString("Unknown");
+    unknownFrame.address = 0;
+    unknownFrame.offset = 0;
+    m_stackTrie.InternFrame(unknownFrame);
+
+    m_sampleWriter = std::unique_ptr<SampleWriter>(CreateSampleWriter());
+    m_workerThread = std::thread(DoSampling, this, pProfInfo, parent, m_outputFile);
+}
+
+SampleWriter *Sampler::CreateSampleWriter()
+{
+    std::string format = ReadEnvironmentVariable("STACKSAMPLER_OUTPUT");
+    if (format == "binary")
     {
-        return WSTR("Unknown");
+        // Binary samples go to their own file, the text file keeps the diagnostic messages
+        std::string fileName = std::tmpnam(nullptr) + std::string(".ssp");
+        FILE *binaryFile = fopen(fileName.c_str(), "wb");
+        if (binaryFile != nullptr)
+        {
+            printf("Writing binary samples to \"%s\"\n", fileName.c_str());
+            m_sampleFile = binaryFile;
+        }
+        else
+        {
+            printf("Unable to open \"%s\", falling back to text output\n", fileName.c_str());
+            format = "";
+        }
     }
 
-    WCHAR wName[LONG_LENGTH];
-    DWORD dwTypeDefFlags = 0;
-    hr = pMDImport->GetTypeDefProps(classToken,
-                                    wName,
-                                    LONG_LENGTH,
-                                    NULL,
-                                    &dwTypeDefFlags,
-                                    NULL);
-    if (FAILED(hr))
+    size_t bufferSize = 4 * 1024 * 1024;
+    std::string bufferSizeKB = ReadEnvironmentVariable("STACKSAMPLER_OUTPUT_BUFFER_KB");
+    if (bufferSizeKB != "")
     {
-        fprintf(m_outputFile, "GetTypeDefProps failed with hr=0x%x\n", hr);
-        return WSTR("Unknown");
+        bufferSize = std::max<size_t>(64, strtoull(bufferSizeKB.c_str(), nullptr, 10)) * 1024;
     }
 
-    WSTRING name = GetModuleName(modId);
-    name += WSTR(" ");
-    name += wName;
+    m_backgroundWriter = std::unique_ptr<BackgroundWriter>(new BackgroundWriter(m_sampleFile, bufferSize, 250));
 
-    if (nTypeArgs > 0)
+    if (format == "stacks")
     {
-        name += WSTR("<");
+        printf("Writing deduplicated stacks\n");
+        return new StackSampleWriter(*m_backgroundWriter, m_symbolCache, m_stackTrie);
     }
-
-    for(ULONG32 i = 0; i < nTypeArgs; i++)
+    else if (format == "binary")
     {
-        name += GetClassName(typeArgs[i]);
-
-        if ((i + 1) != nTypeArgs)
+        return new BinarySampleWriter(*m_backgroundWriter, m_symbolCache, m_stackTrie);
+    }
+    else if (format == "folded")
+    {
+        uint64_t intervalSeconds = 10;
+        std::string intervalSetting = ReadEnvironmentVariable("STACKSAMPLER_FOLDED_INTERVAL_SECONDS");
+        if (intervalSetting != "")
         {
-            name += WSTR(", ");
+            intervalSeconds = std::max<uint64_t>(1, strtoull(intervalSetting.c_str(), nullptr, 10));
         }
-    }
 
-    if (nTypeArgs > 0)
+        std::string fileName = std::tmpnam(nullptr) + std::string(".folded");
+        printf("Writing folded stacks to \"%s\" every %" PRIu64 " seconds\n", fileName.c_str(), intervalSeconds);
+        return new FoldedSampleWriter(*m_backgroundWriter,
+                                      m_symbolCache,
+                                      m_stackTrie,
+                                      fileName,
+                                      intervalSeconds * 1000 * 1000 * 1000);
+    }
+    else if (format == "pprof")
     {
-        name += WSTR(">");
+        uint64_t windowSeconds = 60;
+        std::string windowSetting = ReadEnvironmentVariable("STACKSAMPLER_PPROF_WINDOW_SECONDS");
+        if (windowSetting != "")
+        {
+            windowSeconds = std::max<uint64_t>(1, strtoull(windowSetting.c_str(), nullptr, 10));
+        }
+
+        std::string filePrefix = std::tmpnam(nullptr);
+        printf("Writing pprof profiles to \"%s.<n>.pb\" every %" PRIu64 " seconds\n", filePrefix.c_str(), windowSeconds);
+        return new PprofSampleWriter(*m_backgroundWriter,
+                                     m_symbolCache,
+                                     m_stackTrie,
+                                     filePrefix,
+                                     windowSeconds * 1000 * 1000 * 1000,
+                                     m_samplingIntervalNs,
+                                     m_sampleClock == SampleClock::Cpu ? "cpu" : "wall");
     }
 
-    return name;
+    return new TextSampleWriter(*m_backgroundWriter, m_symbolCache, m_stackTrie);
+}
+
+uint32_t Sampler::GetManagedFrame(FunctionID funcID, COR_PRF_FRAME_INFO frameInfo)
+{
+    return GetManagedFrame(m_symbolCache.GetFunctionKey(funcID, frameInfo));
 }
 
-WSTRING Sampler::GetFunctionName(FunctionID funcID, const COR_PRF_FRAME_INFO frameInfo)
+uint32_t Sampler::GetManagedFrame(const FunctionKey &key)
 {
-    if (funcID == NULL)
+    auto it = m_managedFrameIds.find(key);
+    if (it != m_managedFrameIds.end())
     {
-        return WSTR("Unknown_Native_Function");
+        return it->second;
     }
 
-    ClassID classId = NULL;
-    ModuleID moduleId = NULL;
-    mdToken token = NULL;
-    ULONG32 nTypeArgs = NULL;
-    ClassID typeArgs[SHORT_LENGTH];
-
-    HRESULT hr = m_pCorProfilerInfo->GetFunctionInfo2(funcID,
-                                                   frameInfo,
-                                                   &classId,
-                                                   &moduleId,
-                                                   &token,
-                                                   SHORT_LENGTH,
-                                                   &nTypeArgs,
-                                                   typeArgs);
-    if (FAILED(hr))
+    bool incomplete;
+    Frame frame;
+    frame.kind = FrameKind::Managed;
+    frame.nameId = m_symbolCache.GetFunctionSymbol(key, &incomplete);
+    frame.address = (uint64_t)key.functionId;
+    frame.offset = 0;
+    uint32_t frameId = m_stackTrie.InternFrame(frame);
+    if (!incomplete)
     {
-        fprintf(m_outputFile, "GetFunctionInfo2 failed with hr=0x%x\n", hr);
+        m_managedFrameIds.emplace(key, frameId);
     }
 
-    IMetaDataImport *pMDImport = m_parent->GetMetadataForModule(moduleId);
-    if (pMDImport == NULL)
+    return frameId;
+}
+
+uint32_t Sampler::GetNativeFrame(uintptr_t ip)
+{
+    auto it = m_nativeFrameIds.find(ip);
+    if (it != m_nativeFrameIds.end())
     {
-        return WSTR("Unknown");
+        return it->second;
     }
 
-    WCHAR funcName[STRING_LENGTH];
-    hr = pMDImport->GetMethodProps(token,
-                                    NULL,
-                                    funcName,
-                                    STRING_LENGTH,
-                                    0,
-                                    0,
-                                    NULL,
-                                    NULL,
-                                    NULL,
-                                    NULL);
-    if (FAILED(hr))
+    it = m_unknownNativeFrameIds.find(ip);
+    if (it != m_unknownNativeFrameIds.end())
     {
-        fprintf(m_outputFile, "GetMethodProps failed with hr=0x%x\n", hr);
+        return it->second;
     }
 
-    WSTRING name;
-
-    // If the ClassID returned from GetFunctionInfo is 0, then the function is a shared generic function.
-    if (classId != 0)
+    const char *name = "Unknown";
+    uintptr_t offset = 0;
+    bool found = m_nativeSymbolizer.Lookup(ip, &name, &offset);
+
+    Frame frame;
+    frame.kind = FrameKind::Native;
+    frame.nameId = m_symbolCache.InternString(name);
+    frame.address = (uint64_t)ip;
+    frame.offset = (uint64_t)offset;
+    uint32_t frameId = m_stackTrie.InternFrame(frame);
+    if (found)
     {
-        name += GetClassName(classId);
+        m_nativeFrameIds.emplace(ip, frameId);
     }
     else
     {
-        name += WSTR("SharedGenericFunction");
+        m_unknownNativeFrameIds.emplace(ip, frameId);
     }
 
-    name += WSTR("::");
+    return frameId;
+}
+
+uint32_t Sampler::GetFrame(const RawFrame &frame)
+{
+    return frame.kind == FrameKind::Managed ? GetManagedFrame(frame.function) : GetNativeFrame(frame.ip);
+}
 
-    name += funcName;
+uint32_t Sampler::RecordSample(ThreadID threadID, const std::vector<uint32_t> &frames)
+{
+    return RecordSample(threadID, frames, m_tickWeight);
+}
 
-    // Fill in the type parameters of the generic method
-    if (nTypeArgs > 0)
+uint32_t Sampler::RecordSample(ThreadID threadID, const std::vector<uint32_t> &frames, uint32_t weight)
+{
+    if (frames.empty())
     {
-        name += WSTR("<");
+        return StackTrie::InvalidId;
     }
 
-    for(ULONG32 i = 0; i < nTypeArgs; i++)
-    {
-        name += GetClassName(typeArgs[i]);
+    uint32_t stackId = m_stackTrie.InternStack(frames);
+    RecordStack(threadID, stackId, weight);
+    return stackId;
+}
 
-        if ((i + 1) != nTypeArgs)
-        {
-            name += WSTR(", ");
-        }
-    }
+void Sampler::RecordStack(ThreadID threadID, uint32_t stackId, uint32_t weight)
+{
+    m_sampleWriter->WriteSample(GetTimestamp(), threadID, stackId, weight);
+}
 
-    if (nTypeArgs > 0)
-    {
-        name += WSTR(">");
-    }
+void Sampler::RecordRawSample(ThreadID threadID, const std::vector<RawFrame> &frames)
+{
+    RecordRawSample(threadID, frames, m_tickWeight, nullptr);
+}
 
-    return name;
+void Sampler::RecordRawSample(ThreadID threadID, const std::vector<RawFrame> &frames, uint32_t weight, uint32_t *stackId)
+{
+    DeferredSample sample;
+    sample.timestamp = GetTimestamp();
+    sample.threadID = threadID;
+    sample.weight = weight;
+    sample.frameCount = (uint32_t)frames.size();
+    sample.stackId = stackId;
+    m_deferredSamples.push_back(sample);
+    m_deferredFrames.insert(m_deferredFrames.end(), frames.begin(), frames.end());
 }
 
-// static
-void Sampler::DoSampling(Sampler *sampler, ICorProfilerInfo10 *pProfInfo, CorProfiler *parent, FILE *outputFile)
+void Sampler::ReserveRawSamples(size_t samples, size_t frames)
 {
-    pProfInfo->InitializeCurrentThread();
+    m_deferredSamples.reserve(m_deferredSamples.size() + samples);
+    m_deferredFrames.reserve(m_deferredFrames.size() + frames);
+}
 
-    while (true)
+uint32_t Sampler::ProcessRawSample(ThreadID threadID, const std::vector<RawFrame> &frames, uint32_t weight, std::vector<uint32_t> *frameIds)
+{
+    if (frames.empty())
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return StackTrie::InvalidId;
+    }
 
-        s_waitEvent.Wait();
+    // The frame ID caches are almost always hit, so in practice this is a few hash lookups
+    // per frame and the lock isn't held for long
+    std::lock_guard<std::mutex> lock(m_processingLock);
+    frameIds->clear();
+    for (const RawFrame &frame : frames)
+    {
+        frameIds->push_back(GetFrame(frame));
+    }
 
-        // This is a hack that was convenient for writing this profiler.
-        // It checks if any methods have been jitted yet, but the runtime
-        // can execute managed code from ready to run images without jitting
-        // any code so it won't always work correctly.
-        //
-        // It also isn't strictly necessary to check this, you can suspend the
-        // runtime at any point but for this profiler we don't care until there
-        // are managed callstacks to sample.
-        if (!parent->IsRuntimeExecutingManagedCode())
-        {
-            fprintf(outputFile, "Runtime has not started executing managed code yet.\n");
-            continue;
-        }
+    uint32_t stackId = m_stackTrie.InternStack(*frameIds);
+    RecordStack(threadID, stackId, weight);
+    return stackId;
+}
 
-        if (!sampler->BeforeSampleAllThreads())
-        {
-            continue;
-        }
+void Sampler::ProcessRepeatedSample(ThreadID threadID, uint32_t stackId, uint32_t weight)
+{
+    std::lock_guard<std::mutex> lock(m_processingLock);
+    RecordStack(threadID, stackId, weight);
+}
 
-        ICorProfilerThreadEnum* threadEnum = nullptr;
-        HRESULT hr = pProfInfo->EnumThreads(&threadEnum);
-        if (FAILED(hr))
+void Sampler::FlushDeferredSamples()
+{
+    // Most frames hit m_managedFrameIds/m_nativeFrameIds, only functions and IPs never seen
+    // before go to the symbol cache and symbolizer
+    size_t frameIndex = 0;
+    for (const DeferredSample &sample : m_deferredSamples)
+    {
+        m_resolvedFrames.clear();
+        for (uint32_t i = 0; i < sample.frameCount; ++i)
         {
-            fprintf(outputFile, "Error getting thread enumerator\n");
-            continue;
+            m_resolvedFrames.push_back(GetFrame(m_deferredFrames[frameIndex++]));
         }
 
-        ThreadID threadID;
-        ULONG numReturned;
-        while ((hr = threadEnum->Next(1, &threadID, &numReturned)) == S_OK)
+        uint32_t stackId = StackTrie::InvalidId;
+        if (!m_resolvedFrames.empty())
         {
-            fprintf(outputFile, "Starting stack walk for managed thread id=0x%" PRIx64 "\n", (uint64_t)threadID);
-
-            sampler->SampleThread(threadID);
-
-            fprintf(outputFile, "Ending stack walk for managed thread id=0x%" PRIx64 "\n", (uint64_t)threadID);
+            stackId = m_stackTrie.InternStack(m_resolvedFrames);
+            m_sampleWriter->WriteSample(sample.timestamp, sample.threadID, stackId, sample.weight);
         }
 
-        if (!sampler->AfterSampleAllThreads())
+        if (sample.stackId != nullptr)
         {
-            continue;
+            *sample.stackId = stackId;
         }
     }
-}
 
-Sampler::Sampler(ICorProfilerInfo10* pProfInfo, CorProfiler *parent) :
-    m_workerThread(),
-    m_pCorProfilerInfo(pProfInfo),
-    m_parent(parent),
-    m_outputFile(NULL),
-    m_threadIDMap()
-{
-    std::string fileName = std::tmpnam(nullptr) + std::string(".txt");
-    m_outputFile = fopen(fileName.c_str(), "w+");
-    printf("Writing sampler output to \"%s\"\n", fileName.c_str());
-    m_workerThread = std::thread(DoSampling, this, pProfInfo, parent, m_outputFile);
+    m_deferredSamples.clear();
+    m_deferredFrames.clear();
 }
 
 Sampler::~Sampler()
 {
+    Shutdown();
+
+    m_sampleWriter.reset();
+    m_backgroundWriter.reset();
+
+    if (m_sampleFile != m_outputFile)
+    {
+        fclose(m_sampleFile);
+    }
+
     fclose(m_outputFile);
 }
 
@@ -329,6 +549,44 @@ void Sampler::Stop()
     s_waitEvent.Reset();
 }
 
+void Sampler::Shutdown()
+{
+    if (!m_workerThread.joinable())
+    {
+        return;
+    }
+
+    // The sampling thread notices at its next deadline, at most one interval away. Signalling
+    // the event wakes it up if sampling was stopped.
+    m_shutdown.store(true);
+    s_waitEvent.Signal();
+    m_workerThread.join();
+
+    SamplingStopped();
+
+    uint64_t missedTicks = m_missedTicks.load();
+    if (missedTicks != 0)
+    {
+        fprintf(m_outputFile, "Sampling fell behind and missed %" PRIu64 " of %" PRIu64 " ticks\n",
+            missedTicks,
+            m_ticks.load() + missedTicks);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_processingLock);
+        m_sampleWriter->Finish(GetTimestamp());
+    }
+
+    // Joins the I/O thread once everything it was handed is on disk
+    m_backgroundWriter->Shutdown();
+    fflush(m_outputFile);
+}
+
+void Sampler::SamplingStopped()
+{
+
+}
+
 void Sampler::ThreadCreated(ThreadID threadId)
 {
     NativeThreadInfo nativeThreadInfo;
@@ -336,55 +594,60 @@ void Sampler::ThreadCreated(ThreadID threadId)
     nativeThreadInfo.threadID = GetCurrentNativeThreadID();
     nativeThreadInfo.stackBase = GetCurrentThreadStackBase();
 
-    m_threadIDMap.insertNew(threadId, nativeThreadInfo);
+    if (!m_threadIDMap.Insert(threadId, nativeThreadInfo))
+    {
+        fprintf(m_outputFile, "More than %zu live threads, managed thread id=0x%" PRIx64 " won't be sampled\n", MaxThreads, (uint64_t)threadId);
+    }
 }
 
 void Sampler::ThreadDestroyed(ThreadID threadId)
 {
-    // should probably delete it from the map
-}
-
-pthread_t Sampler::GetCurrentPThreadID()
-{
-    return pthread_self();
+    NativeThreadInfo info;
+    if (m_threadIDMap.Remove(threadId, &info))
+    {
+        m_threadStateReader.Forget(info.threadID);
+    }
 }
 
-pthread_t Sampler::GetPThreadID(ThreadID threadID)
+ThreadState Sampler::GetThreadState(ThreadID threadID)
 {
-    auto it = m_threadIDMap.find(threadID);
-    if (it == m_threadIDMap.end())
+    ThreadStateInfo info;
+    if (!GetThreadStateInfo(threadID, &info))
     {
-        assert(!"Unexpected thread found");
-        return 0;
+        return ThreadState::Running;
     }
 
-    pthread_t pThreadId = it->second.pThreadID;
-    return pThreadId;
+    return info.state;
 }
 
-NativeThreadID Sampler::GetNativeThreadID(ThreadID threadID)
+bool Sampler::GetThreadStateInfo(ThreadID threadID, ThreadStateInfo *info)
 {
-    auto it = m_threadIDMap.find(threadID);
-    if (it == m_threadIDMap.end())
+    NativeThreadInfo nativeThreadInfo;
+    if (!GetNativeThreadInfo(threadID, &nativeThreadInfo))
     {
-        assert(!"Unexpected thread found");
-        return 0;
+        return false;
     }
 
-    NativeThreadID nativeThreadId = it->second.threadID;
-    return nativeThreadId;
+    return m_threadStateReader.Read(nativeThreadInfo.threadID, info);
 }
 
+void Sampler::ModuleUnloaded(ModuleID moduleId)
+{
+    m_symbolCache.ModuleUnloaded(moduleId);
+    m_frameIdsStale.store(true);
+}
 
-void * Sampler::GetStackBase(ThreadID threadID)
+void Sampler::FunctionCompiled(FunctionID functionId, ReJITID rejitId)
 {
-    auto it = m_threadIDMap.find(threadID);
-    if (it == m_threadIDMap.end())
-    {
-        assert(!"Unexpected thread found");
-        return 0;
-    }
 
-    void *stackBase = it->second.stackBase;
-    return stackBase;
+}
+
+pthread_t Sampler::GetCurrentPThreadID()
+{
+    return pthread_self();
+}
+
+bool Sampler::GetNativeThreadInfo(ThreadID threadID, NativeThreadInfo *info)
+{
+    return m_threadIDMap.Find(threadID, info);
 }
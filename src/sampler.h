@@ -9,24 +9,39 @@
 #include <atomic>
 #include <vector>
 #include <utility>
+#include <memory>
+#include <unordered_map>
 #include <pthread.h>
 
 #include "common.h"
+#include "symbol_cache.h"
+#include "native_symbolizer.h"
+#include "stack_trie.h"
+#include "sample_writer.h"
+#include "pprof_writer.h"
+#include "overhead_governor.h"
+#include "thread_state_reader.h"
+#include "thread_registry.h"
 
 class CorProfiler;
 
-enum class ThreadState
+// What the sampling interval is measured in. Wall samples every thread each interval, Cpu
+// samples a thread each time it has used an interval's worth of CPU.
+enum class SampleClock
 {
-    Running = 1,
-    Suspended = 2,
-    Dead = 3
+    Wall = 1,
+    Cpu = 2
 };
 
-#ifdef __APPLE__
-    typedef pthread_t NativeThreadID;
-#elif __linux__
-    typedef pid_t NativeThreadID;
-#endif
+// A frame as the stack walk saw it, before any names have been looked up
+struct RawFrame
+{
+    FrameKind kind;
+    // Managed frames only
+    FunctionKey function;
+    // Native frames only
+    uintptr_t ip;
+};
 
 typedef struct
 {
@@ -41,30 +56,145 @@ private:
     static constexpr char const *OutputName = "samples.txt";
     std::thread m_workerThread;
     static ManualEvent s_waitEvent;
+    // Set by Shutdown, the sampling thread exits instead of starting another tick
+    std::atomic<bool> m_shutdown;
+
+    std::atomic<uint64_t> m_ticks;
+    std::atomic<uint64_t> m_missedTicks;
+
+    struct DeferredSample
+    {
+        uint64_t timestamp;
+        ThreadID threadID;
+        uint32_t weight;
+        uint32_t frameCount;
+        // Where to put the stack ID once it's known, can be null
+        uint32_t *stackId;
+    };
+
+    // Raw samples recorded this tick, resolved by FlushDeferredSamples
+    std::vector<DeferredSample> m_deferredSamples;
+    std::vector<RawFrame> m_deferredFrames;
+    std::vector<uint32_t> m_resolvedFrames;
+
+    // Frame IDs by what the walk saw, so names are only looked up for new functions and IPs.
+    // Cleared at the start of the tick after a module unloads, since FunctionIDs get reused.
+    std::unordered_map<FunctionKey, uint32_t, FunctionKeyHash> m_managedFrameIds;
+    std::unordered_map<uintptr_t, uint32_t> m_nativeFrameIds;
+    // IPs the symbolizer couldn't name, kept apart so they can be retried once it has listed the
+    // loaded objects again (e.g. after a dlopen)
+    std::unordered_map<uintptr_t, uint32_t> m_unknownNativeFrameIds;
+    std::atomic<bool> m_frameIdsStale;
+
+    // Set once running out of frame, stack or name IDs has been logged
+    bool m_reportedFullTables;
+
+    void FlushDeferredSamples();
+
+    // Held by worker threads while they name, intern and write a sample, see ProcessRawSample
+    std::mutex m_processingLock;
+    uint64_t m_lastProcessingCpuNs;
+
+    static double ReadOverheadBudget();
+    void UpdateGovernor(uint64_t samplingCpuNs);
 
     static void DoSampling(Sampler *sampler, ICorProfilerInfo10* pProfInfo, CorProfiler *parent, FILE *outputFile);
+    static uint64_t ReadSamplingInterval();
+    // deadline is a GetTimestamp value, implemented per platform
+    static void SleepUntil(uint64_t deadline);
+    static FILE *OpenOutputFile();
+    SampleWriter *CreateSampleWriter();
 
 protected:
     ICorProfilerInfo10* m_pCorProfilerInfo;
     CorProfiler *m_parent;
     FILE *m_outputFile;
-    ThreadSafeMap<uintptr_t, NativeThreadInfo> m_threadIDMap;
 
-    WSTRING GetClassName(ClassID classId);
-    WSTRING GetModuleName(ModuleID modId);
-    WSTRING GetFunctionName(FunctionID funcID, const COR_PRF_FRAME_INFO frameInfo);
+    // Room for this many live managed threads, lookups get slower as it fills up
+    static constexpr size_t MaxThreads = 4096;
+    ThreadRegistry<NativeThreadInfo> m_threadIDMap;
+
+    // Ticks are scheduled on absolute deadlines so the period doesn't stretch by however long
+    // sampling took. A tick that starts more than one interval late counts the intervals it
+    // skipped as missed, and its samples are weighted to cover them.
+    uint64_t m_samplingIntervalNs;
+    SampleClock m_sampleClock;
+    uint32_t m_tickWeight;
+
+    // The overhead governor stretches the interval to m_samplingIntervalNs * m_intervalMultiplier
+    // and weights samples by the multiplier so they stay in units of the configured interval
+    std::atomic<uint32_t> m_intervalMultiplier;
+
+    // Reset at the start of each tick, subclasses add what they spent on the sampled threads
+    uint64_t m_tickSuspendedNs;
+    uint64_t m_tickHandlerNs;
+
+    // CPU time threads other than the sampling thread have spent processing samples, the
+    // governor counts it as sampling cost
+    std::atomic<uint64_t> m_processingCpuNs;
+
+    OverheadGovernor m_governor;
+    uint64_t m_lastWriteCpuNs;
+
+    // Shared by every sampler so a function is only resolved and converted to UTF-8 once
+    SymbolCache m_symbolCache;
+    NativeSymbolizer m_nativeSymbolizer;
+    StackTrie m_stackTrie;
+
+    // Samples go through the background writer so the sampling thread never waits on disk.
+    // m_sampleFile is m_outputFile unless the format needs a file of its own.
+    FILE *m_sampleFile;
+    std::unique_ptr<BackgroundWriter> m_backgroundWriter;
+    std::unique_ptr<SampleWriter> m_sampleWriter;
+
+    // With STACKSAMPLER_DEFER_SYMBOLS set samplers should record RawFrames with RecordRawSample
+    // instead of calling Get*Frame, so nothing is looked up by name during the walk
+    bool m_deferSymbols;
+
+    uint32_t GetManagedFrame(FunctionID funcID, COR_PRF_FRAME_INFO frameInfo);
+    uint32_t GetManagedFrame(const FunctionKey &key);
+    uint32_t GetNativeFrame(uintptr_t ip);
+    uint32_t GetFrame(const RawFrame &frame);
+
+    // frames are frame IDs from the Get*Frame methods, leaf first. Without a weight the sample
+    // counts for however many intervals the current tick covers. Returns the stack ID the
+    // sample was recorded with, StackTrie::InvalidId if there were no frames.
+    uint32_t RecordSample(ThreadID threadID, const std::vector<uint32_t> &frames);
+    uint32_t RecordSample(ThreadID threadID, const std::vector<uint32_t> &frames, uint32_t weight);
+    // Records a sample of a stack that has already been interned
+    void RecordStack(ThreadID threadID, uint32_t stackId, uint32_t weight);
+
+    // Copies the frames, they're resolved and the sample written once the tick is over. If
+    // stackId isn't null it gets the sample's stack ID then, StackTrie::InvalidId if there
+    // were no frames.
+    void RecordRawSample(ThreadID threadID, const std::vector<RawFrame> &frames);
+    void RecordRawSample(ThreadID threadID, const std::vector<RawFrame> &frames, uint32_t weight, uint32_t *stackId);
+    // Makes room for this many raw samples and frames in the tick, so recording them doesn't
+    // allocate. Room left over from earlier ticks is kept.
+    void ReserveRawSamples(size_t samples, size_t frames);
+
+    // Names, interns and writes a sample straight away. Unlike the methods above these are safe
+    // to call from several threads at once, everything they touch is behind m_processingLock.
+    // frameIds is scratch space the caller can reuse between samples. Returns the stack ID.
+    uint32_t ProcessRawSample(ThreadID threadID, const std::vector<RawFrame> &frames, uint32_t weight, std::vector<uint32_t> *frameIds);
+    void ProcessRepeatedSample(ThreadID threadID, uint32_t stackId, uint32_t weight);
+
+    ThreadStateReader m_threadStateReader;
 
     ThreadState GetThreadState(ThreadID threadID);
+    bool GetThreadStateInfo(ThreadID threadID, ThreadStateInfo *info);
 
     // On linux the pthread APIs uses a pthread_t identifier, but the /proc/self/task/[tid] data
     // uses a different type of tid unrelated to pthread_t to represent threads. On macos we can use
     // pthread_t for everything so both NativeThreadID and PThreadID are the same on macos.
     pthread_t GetCurrentPThreadID();
-    pthread_t GetPThreadID(ThreadID threadID);
     NativeThreadID GetCurrentNativeThreadID();
-    NativeThreadID GetNativeThreadID(ThreadID threadID);
-    void *GetStackBase(ThreadID threadID);
     void *GetCurrentThreadStackBase();
+    // Lowest address of the current thread's stack, null if it isn't known
+    void *GetCurrentThreadStackLimit();
+
+    // Everything recorded for the thread in ThreadCreated, false if it isn't known
+    bool GetNativeThreadInfo(ThreadID threadID, NativeThreadInfo *info);
 
 
     virtual bool BeforeSampleAllThreads() = 0;
@@ -72,13 +202,32 @@ protected:
 
     virtual bool SampleThread(ThreadID threadID) = 0;
 
+    // Called on the sampling thread when the governor changes the interval
+    virtual void SamplingIntervalChanged(uint64_t intervalNs);
+
+    // Called at the start of each tick before anything is reclaimed. Samplers that hand stacks
+    // to other threads wait here until they're done with the last tick's.
+    virtual void WaitForProcessing();
+
+    // Called by Shutdown once the sampling thread has exited, before the writers are flushed.
+    // Samplers that record samples from other threads stop them here.
+    virtual void SamplingStopped();
+
 public:
-    Sampler(ICorProfilerInfo10* pProfInfo, CorProfiler *parent);
+    Sampler(ICorProfilerInfo10* pProfInfo, CorProfiler *parent, SampleClock sampleClock);
     virtual ~Sampler();
 
     void Start();
     void Stop();
+    // Stops the sampling thread and writes out everything recorded so far. Called when the
+    // runtime shuts down, since the sampler isn't necessarily ever destroyed. Subclasses have
+    // to call it from their destructors too, it does nothing the second time.
+    void Shutdown();
 
     virtual void ThreadCreated(ThreadID threadId);
     virtual void ThreadDestroyed(ThreadID threadId);
+    virtual void ModuleUnloaded(ModuleID moduleId);
+    // Called when code for a function is jitted or loaded precompiled, rejitId is 0 unless
+    // it's a ReJIT
+    virtual void FunctionCompiled(FunctionID functionId, ReJITID rejitId);
 };
@@ -2,76 +2,18 @@
 // The .NET Foundation licenses this file to you under the MIT license.
 // See the LICENSE file in the project root for more information.
 
-#include <fstream>
-#include <iostream>
 #include <string>
 #include <unistd.h>
 #include <sys/types.h>
 #include <cstdio>
+#include <cerrno>
+#include <time.h>
 
 #include "CorProfiler.h"
 #include "sampler.h"
 
-using std::ifstream;
 using std::string;
 
-ThreadState Sampler::GetThreadState(ThreadID threadID)
-{
-    NativeThreadID nativeThreadID = GetNativeThreadID(threadID);
-
-    // TODO: single character file access is probably not the best for performance
-    string fileName = "/proc/self/task/" + std::to_string((uintptr_t)nativeThreadID) + "/stat";
-    fprintf(m_outputFile, "Parsing contents of %s for thread\n", fileName.c_str());
-    ifstream threadState(fileName);
-
-    char ch;
-    bool sawCloseParen = false;
-    while (threadState.get(ch) && threadState.good())
-    {
-        if (sawCloseParen && ch != ' ')
-        {
-            break;
-        }
-
-        if (ch == ')')
-        {
-            sawCloseParen = true;
-        }
-    }
-
-    fprintf(m_outputFile, "thread state char=%c\n", ch);
-
-    // TODO: should verify that this is completely trustworthy. I did some basic investigation and it seems
-    // to map, i.e. any threads marked as ThreadState::Suspended seemed to be actually suspended.
-    switch(ch)
-    {
-        case 'R': // Running
-            return ThreadState::Running;
-
-        case 'I': // Idle
-        case 'W': // Paging or waking
-        case 'K': // Wakekill
-            // return ThreadState::Transition;
-        case 'D': // Waiting on disk
-        case 'P': // Parked
-        case 'S': // Sleeping in a wait
-        case 't': // Tracing/debugging
-        case 'T': // Stopped on a signal
-            return ThreadState::Suspended;
-
-        case 'x': // dead
-        case 'X': // Dead
-        case 'Z': // Zombie
-            return ThreadState::Dead;
-
-        default:
-            fprintf(m_outputFile, "Saw invalid character in thread state %c\n", ch);
-            return ThreadState::Running;
-    }
-
-    return ThreadState::Running;
-}
-
 NativeThreadID Sampler::GetCurrentNativeThreadID()
 {
     return gettid();
@@ -94,3 +36,36 @@ void *Sampler::GetCurrentThreadStackBase()
 
     return nullptr;
 }
+
+void *Sampler::GetCurrentThreadStackLimit()
+{
+    void *stackAddr = nullptr;
+    pthread_attr_t attrs;
+    if (pthread_getattr_np(pthread_self(), &attrs) == 0)
+    {
+        size_t stackSize;
+        if (pthread_attr_getstack(&attrs, &stackAddr, &stackSize) != 0)
+        {
+            stackAddr = nullptr;
+        }
+
+        pthread_attr_destroy(&attrs);
+    }
+
+    return stackAddr;
+}
+
+// static
+void Sampler::SleepUntil(uint64_t deadline)
+{
+    // GetTimestamp is steady_clock, which is CLOCK_MONOTONIC on linux
+    struct timespec deadlineSpec;
+    deadlineSpec.tv_sec = (time_t)(deadline / 1000000000);
+    deadlineSpec.tv_nsec = (long)(deadline % 1000000000);
+
+    // Restart if a signal interrupts us, the deadline is absolute so no time is lost
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadlineSpec, nullptr) == EINTR)
+    {
+
+    }
+}
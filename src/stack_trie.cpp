@@ -0,0 +1,32 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include "stack_trie.h"
+
+StackTrie::StackTrie() :
+    m_frames(),
+    m_nodes()
+{
+    uint32_t rootId = m_nodes.Intern(StackNode { InvalidId, InvalidId });
+    assert(rootId == RootStackId);
+}
+
+uint32_t StackTrie::InternStack(const std::vector<uint32_t> &frames)
+{
+    uint32_t stackId = RootStackId;
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it)
+    {
+        // Only a full table hands back the root for a push, carrying on from there would
+        // record the rest of the frames as if they were called from the root
+        uint32_t childId = Push(stackId, *it);
+        if (childId == RootStackId)
+        {
+            break;
+        }
+
+        stackId = childId;
+    }
+
+    return stackId;
+}
@@ -0,0 +1,128 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "intern_table.h"
+
+enum class FrameKind : uint8_t
+{
+    Managed = 1,
+    Native = 2
+};
+
+// One distinct frame. Managed frames are identified by their symbol (so all samples in a
+// function share a frame), native frames by their IP.
+struct Frame
+{
+    FrameKind kind;
+    // String table ID of the function name
+    uint32_t nameId;
+    // FunctionID for managed frames, the instruction pointer for native frames
+    uint64_t address;
+    // Offset of address from the start of the native symbol, 0 for managed frames
+    uint64_t offset;
+
+    bool operator==(const Frame &other) const
+    {
+        return kind == other.kind
+            && nameId == other.nameId
+            && address == other.address
+            && offset == other.offset;
+    }
+};
+
+struct FrameHash
+{
+    size_t operator()(const Frame &frame) const
+    {
+        size_t hash = std::hash<uint64_t>()(frame.address);
+        hash ^= std::hash<uint32_t>()(frame.nameId) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        hash ^= (size_t)frame.kind + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        return hash;
+    }
+};
+
+// A node is a frame plus the stack that called it, so a node ID stands for the whole stack
+// from the thread's first frame down to this one.
+struct StackNode
+{
+    uint32_t parent;
+    uint32_t frameId;
+
+    bool operator==(const StackNode &other) const
+    {
+        return parent == other.parent && frameId == other.frameId;
+    }
+};
+
+struct StackNodeHash
+{
+    size_t operator()(const StackNode &node) const
+    {
+        return std::hash<uint64_t>()(((uint64_t)node.parent << 32) | node.frameId);
+    }
+};
+
+// Hash-consed call stack trie. Every distinct stack gets one stable ID no matter how many
+// times it is sampled, so a sample only has to record (timestamp, thread, stackId) and
+// counting samples per stack is an increment.
+class StackTrie
+{
+private:
+    InternTable<Frame, FrameHash> m_frames;
+    InternTable<StackNode, StackNodeHash> m_nodes;
+
+public:
+    // The root is the empty stack, every real stack descends from it
+    static constexpr uint32_t RootStackId = 0;
+    static constexpr uint32_t InvalidId = UINT32_MAX;
+
+    StackTrie();
+    ~StackTrie() = default;
+
+    uint32_t InternFrame(const Frame &frame)
+    {
+        return m_frames.Intern(frame);
+    }
+
+    const Frame &GetFrame(uint32_t frameId) const
+    {
+        return m_frames.Get(frameId);
+    }
+
+    uint32_t FrameCount() const
+    {
+        return m_frames.Count();
+    }
+
+    const StackNode &GetNode(uint32_t stackId) const
+    {
+        return m_nodes.Get(stackId);
+    }
+
+    uint32_t StackCount() const
+    {
+        return m_nodes.Count();
+    }
+
+    uint32_t Push(uint32_t parentStackId, uint32_t frameId)
+    {
+        return m_nodes.Intern(StackNode { parentStackId, frameId });
+    }
+
+    // frames is ordered the way stack walks produce them, leaf (most recent call) first
+    uint32_t InternStack(const std::vector<uint32_t> &frames);
+
+    // True once frames or stacks have run out of IDs. New frames then come back as frame 0.
+    // New stacks keep the root end they share with known stacks, and the frames leafward of
+    // where they branch off are dropped.
+    bool Full() const
+    {
+        return m_frames.Full() || m_nodes.Full();
+    }
+};
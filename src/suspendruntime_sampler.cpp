@@ -3,17 +3,14 @@
 // See the LICENSE file in the project root for more information.
 
 #include <thread>
+#include <algorithm>
 #include <cwchar>
 #include <cstdio>
 #include <cinttypes>
-#include <locale>
-#include <codecvt>
 
 #include "CorProfiler.h"
 #include "suspendruntime_sampler.h"
 
-using std::wstring_convert;
-using std::codecvt_utf8;
 using std::string;
 
 static HRESULT __stdcall DoStackSnapshotStackSnapShotCallbackWrapper(
@@ -35,10 +32,23 @@ static HRESULT __stdcall DoStackSnapshotStackSnapShotCallbackWrapper(
         clientData);
 }
 
+// Guesses for how much a tick walks, until one has been seen
+static constexpr size_t InitialThreads = 64;
+static constexpr size_t InitialFrames = 8192;
+static constexpr size_t InitialThreadFrames = 1024;
+
 bool SuspendRuntimeSampler::BeforeSampleAllThreads()
 {
-    fprintf(m_outputFile, "Suspending runtime\n");
+    // Anything the walks need is allocated now, while threads are still running. A quarter
+    // more than the biggest tick so far covers a few new threads or deeper stacks.
+    ReserveRawSamples(m_peakThreads + m_peakThreads / 4, m_peakFrames + m_peakFrames / 4);
+    m_snapshotFailures.reserve(m_peakThreads + m_peakThreads / 4);
+    m_tickThreads = 0;
+    m_tickFrames = 0;
+
+    m_suspendStart = GetTimestamp();
     HRESULT hr = m_pCorProfilerInfo->SuspendRuntime();
+    m_suspendedAt = GetTimestamp();
     if (FAILED(hr))
     {
         fprintf(m_outputFile, "Error suspending runtime... hr=0x%x \n", hr);
@@ -50,8 +60,37 @@ bool SuspendRuntimeSampler::BeforeSampleAllThreads()
 
 bool SuspendRuntimeSampler::AfterSampleAllThreads()
 {
-    fprintf(m_outputFile, "Resuming runtime\n");
     HRESULT hr = m_pCorProfilerInfo->ResumeRuntime();
+    uint64_t pauseNs = GetTimestamp() - m_suspendStart;
+    m_tickSuspendedNs += pauseNs;
+
+    // Threads are running again, everything from here on is off the pause
+    m_pauses++;
+    m_totalPauseNs += pauseNs;
+    m_longestPauseNs = std::max(m_longestPauseNs, pauseNs);
+    m_peakThreads = std::max(m_peakThreads, m_tickThreads);
+    m_peakFrames = std::max(m_peakFrames, m_tickFrames);
+
+    fprintf(m_outputFile, "Runtime paused for %" PRIu64 "us (%" PRIu64 "us waiting for the suspension), walked %zu threads and %zu frames\n",
+        pauseNs / 1000,
+        (m_suspendedAt - m_suspendStart) / 1000,
+        m_tickThreads,
+        m_tickFrames);
+
+    for (const SnapshotFailure &failure : m_snapshotFailures)
+    {
+        if (failure.hr == E_FAIL)
+        {
+            fprintf(m_outputFile, "Managed thread id=0x%" PRIx64 " has no managed frames to walk \n", (uint64_t)failure.threadID);
+        }
+        else
+        {
+            fprintf(m_outputFile, "DoStackSnapshot for thread id=0x%" PRIx64 " failed with hr=0x%x \n", (uint64_t)failure.threadID, failure.hr);
+        }
+    }
+
+    m_snapshotFailures.clear();
+
     if (FAILED(hr))
     {
         fprintf(m_outputFile, "ResumeRuntime failed with hr=0x%x \n", hr);
@@ -63,7 +102,9 @@ bool SuspendRuntimeSampler::AfterSampleAllThreads()
 
 bool SuspendRuntimeSampler::SampleThread(ThreadID threadID)
 {
-   HRESULT hr = m_pCorProfilerInfo->DoStackSnapshot(threadID,
+    m_rawFrames.clear();
+
+    HRESULT hr = m_pCorProfilerInfo->DoStackSnapshot(threadID,
                                                   DoStackSnapshotStackSnapShotCallbackWrapper,
                                                   COR_PRF_SNAPSHOT_REGISTER_CONTEXT,
                                                   (void *)this,
@@ -71,37 +112,60 @@ bool SuspendRuntimeSampler::SampleThread(ThreadID threadID)
                                                   0);
     if (FAILED(hr))
     {
-        if (hr == E_FAIL)
-        {
-            fprintf(m_outputFile, "Managed thread id=0x%" PRIx64 " has no managed frames to walk \n", (uint64_t)threadID);
-        }
-        else
-        {
-            fprintf(m_outputFile, "DoStackSnapshot for thread id=0x%" PRIx64 " failed with hr=0x%x \n", (uint64_t)threadID, hr);
-        }
+        // Printing takes the file lock and might wait on the disk, so it's left until the
+        // runtime has resumed
+        m_snapshotFailures.push_back({ threadID, hr });
     }
 
+    // Always deferred whatever STACKSAMPLER_DEFER_SYMBOLS says, looking up names here would
+    // make every thread wait for them
+    RecordRawSample(threadID, m_rawFrames);
+    m_tickThreads++;
+    m_tickFrames += m_rawFrames.size();
+
     return true;
 }
 
 
 SuspendRuntimeSampler::SuspendRuntimeSampler(ICorProfilerInfo10* pProfInfo, CorProfiler *parent) :
-    Sampler(pProfInfo, parent)
+    Sampler(pProfInfo, parent, SampleClock::Wall),
+    m_rawFrames(),
+    m_snapshotFailures(),
+    m_tickThreads(0),
+    m_tickFrames(0),
+    m_peakThreads(InitialThreads),
+    m_peakFrames(InitialFrames),
+    m_suspendStart(0),
+    m_suspendedAt(0),
+    m_pauses(0),
+    m_totalPauseNs(0),
+    m_longestPauseNs(0)
 {
+    m_rawFrames.reserve(InitialThreadFrames);
+}
 
+SuspendRuntimeSampler::~SuspendRuntimeSampler()
+{
+    Shutdown();
+
+    if (m_pauses != 0)
+    {
+        fprintf(m_outputFile, "Suspended the runtime %" PRIu64 " times, paused for %" PRIu64 "us on average and %" PRIu64 "us at most\n",
+            m_pauses,
+            m_totalPauseNs / m_pauses / 1000,
+            m_longestPauseNs / 1000);
+    }
 }
 
 HRESULT SuspendRuntimeSampler::StackSnapshotCallback(FunctionID funcId, UINT_PTR ip, COR_PRF_FRAME_INFO frameInfo, ULONG32 contextSize, BYTE context[], void* clientData)
 {
-    WSTRING functionName = GetFunctionName(funcId, frameInfo);
-
-#if WIN32
-    wstring_convert<codecvt_utf8<wchar_t>, wchar_t> convert;
-#else // WIN32
-    wstring_convert<codecvt_utf8<char16_t>, char16_t> convert;
-#endif // WIN32
+    // The exact instantiation of generic code can only be asked for while frameInfo is
+    // valid, so the key is built now. That's a cache hit for anything seen before.
+    RawFrame frame;
+    frame.kind = FrameKind::Managed;
+    frame.function = m_symbolCache.GetFunctionKey(funcId, frameInfo);
+    frame.ip = (uintptr_t)ip;
+    m_rawFrames.push_back(frame);
 
-    string printable = convert.to_bytes(functionName);
-    fprintf(m_outputFile, "    %s (funcId=0x%" PRIx64 ")\n", printable.c_str(), (uint64_t)funcId);
     return S_OK;
 }
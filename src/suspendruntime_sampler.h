@@ -6,8 +6,39 @@
 
 #include "sampler.h"
 
+// Every managed thread is stalled from SuspendRuntime to ResumeRuntime, so this sampler does as
+// little as it can in between. The walks only record FunctionIDs and IPs (RawFrames) in to
+// buffers sized before suspending, and nothing is printed. Names are looked up, samples written
+// and failures reported once the runtime is running again.
 class SuspendRuntimeSampler : public Sampler
 {
+private:
+    struct SnapshotFailure
+    {
+        ThreadID threadID;
+        HRESULT hr;
+    };
+
+    // Frames of the thread currently being walked, filled in by StackSnapshotCallback
+    std::vector<RawFrame> m_rawFrames;
+    // DoStackSnapshot failures this tick, printed after ResumeRuntime
+    std::vector<SnapshotFailure> m_snapshotFailures;
+
+    // What the current tick walked, and the most any tick has. Buffers are reserved for the
+    // most seen before suspending, so a tick only allocates while suspended if it sees more.
+    size_t m_tickThreads;
+    size_t m_tickFrames;
+    size_t m_peakThreads;
+    size_t m_peakFrames;
+
+    // When the current tick asked for the suspension and when it got it
+    uint64_t m_suspendStart;
+    uint64_t m_suspendedAt;
+
+    uint64_t m_pauses;
+    uint64_t m_totalPauseNs;
+    uint64_t m_longestPauseNs;
+
 protected:
     virtual bool BeforeSampleAllThreads();
     virtual bool AfterSampleAllThreads();
@@ -16,7 +47,7 @@ protected:
 
 public:
     SuspendRuntimeSampler(ICorProfilerInfo10* pProfInfo, CorProfiler *parent);
-    virtual ~SuspendRuntimeSampler() = default;
+    virtual ~SuspendRuntimeSampler();
 
     HRESULT StackSnapshotCallback(FunctionID funcId,
         UINT_PTR ip,
@@ -25,4 +56,3 @@ public:
         BYTE context[],
         void* clientData);
 };
-
@@ -0,0 +1,479 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <cstdio>
+#include <cinttypes>
+#include <locale>
+#include <codecvt>
+#include <algorithm>
+
+#include "CorProfiler.h"
+#include "symbol_cache.h"
+
+using std::wstring_convert;
+using std::codecvt_utf8;
+using std::string;
+using std::vector;
+
+SymbolCache::SymbolCache(ICorProfilerInfo10* pProfInfo, CorProfiler *parent, FILE *outputFile) :
+    m_pCorProfilerInfo(pProfInfo),
+    m_parent(parent),
+    m_outputFile(outputFile),
+    m_strings(),
+    m_instantiations(),
+    m_lock(),
+    m_functions(),
+    m_symbols(),
+    m_classNames(),
+    m_moduleNames(),
+    m_unknownId(0)
+{
+    // Reserve instantiation ID 0 for "no extra type arguments"
+    m_instantiations.Intern(vector<ClassID>());
+    m_unknownId = m_strings.Intern("Unknown");
+}
+
+// static
+string SymbolCache::ToUtf8(const WCHAR *str)
+{
+#if WIN32
+    wstring_convert<codecvt_utf8<wchar_t>, wchar_t> convert;
+#else // WIN32
+    wstring_convert<codecvt_utf8<char16_t>, char16_t> convert;
+#endif // WIN32
+
+    return convert.to_bytes(str);
+}
+
+uint32_t SymbolCache::GetModuleNameId(ModuleID modId)
+{
+    {
+        std::shared_lock lock(m_lock);
+        auto it = m_moduleNames.find(modId);
+        if (it != m_moduleNames.end())
+        {
+            return it->second;
+        }
+    }
+
+    WCHAR moduleFullName[STRING_LENGTH];
+    ULONG nameLength = 0;
+    AssemblyID assemID;
+
+    if (modId == NULL)
+    {
+        fprintf(m_outputFile, "NULL modId passed to GetModuleName\n");
+        return m_unknownId;
+    }
+
+    HRESULT hr = m_pCorProfilerInfo->GetModuleInfo(modId,
+                                                NULL,
+                                                STRING_LENGTH,
+                                                &nameLength,
+                                                moduleFullName,
+                                                &assemID);
+    if (FAILED(hr))
+    {
+        fprintf(m_outputFile, "GetModuleInfo failed with hr=0x%x\n", hr);
+        return m_unknownId;
+    }
+
+    // Strip everything up to the last \ or / character
+    WCHAR *name = moduleFullName;
+    for (WCHAR *index = moduleFullName; *index != 0; ++index)
+    {
+        if (*index == '\\' || *index == '/')
+        {
+            name = index + 1;
+        }
+    }
+
+    uint32_t nameId = m_strings.Intern(ToUtf8(name));
+
+    std::unique_lock lock(m_lock);
+    m_moduleNames.emplace(modId, nameId);
+    return nameId;
+}
+
+uint32_t SymbolCache::GetClassNameId(ClassID classId, bool *isGeneric, bool *incomplete)
+{
+    {
+        std::shared_lock lock(m_lock);
+        auto it = m_classNames.find(classId);
+        if (it != m_classNames.end())
+        {
+            *isGeneric |= it->second.generic;
+            return it->second.nameId;
+        }
+    }
+
+    ModuleID modId;
+    mdTypeDef classToken;
+    ClassID parentClassID;
+    ULONG32 nTypeArgs;
+    ClassID typeArgs[SHORT_LENGTH];
+    HRESULT hr = S_OK;
+
+    if (classId == NULL)
+    {
+        fprintf(m_outputFile, "NULL classId passed to GetClassName\n");
+        return m_unknownId;
+    }
+
+    hr = m_pCorProfilerInfo->GetClassIDInfo2(classId,
+                                &modId,
+                                &classToken,
+                                &parentClassID,
+                                SHORT_LENGTH,
+                                &nTypeArgs,
+                                typeArgs);
+    if (CORPROF_E_CLASSID_IS_ARRAY == hr)
+    {
+        // We have a ClassID of an array.
+        return m_strings.Intern("ArrayClass");
+    }
+    else if (CORPROF_E_CLASSID_IS_COMPOSITE == hr)
+    {
+        // We have a composite class
+        return m_strings.Intern("CompositeClass");
+    }
+    else if (CORPROF_E_DATAINCOMPLETE == hr)
+    {
+        // type-loading is not yet complete. Cannot do anything about it, and it isn't cached
+        // so a later sample gets the real name.
+        *incomplete = true;
+        return m_strings.Intern("DataIncomplete");
+    }
+    else if (FAILED(hr))
+    {
+        fprintf(m_outputFile, "GetClassIDInfo returned hr=0x%x for classID=0x%" PRIx64 "\n", hr, (uint64_t)classId);
+        return m_unknownId;
+    }
+
+    IMetaDataImport *pMDImport = m_parent->GetMetadataForModule(modId);
+    if (pMDImport == NULL)
+    {
+        return m_unknownId;
+    }
+
+    WCHAR wName[LONG_LENGTH];
+    DWORD dwTypeDefFlags = 0;
+    hr = pMDImport->GetTypeDefProps(classToken,
+                                    wName,
+                                    LONG_LENGTH,
+                                    NULL,
+                                    &dwTypeDefFlags,
+                                    NULL);
+    if (FAILED(hr))
+    {
+        fprintf(m_outputFile, "GetTypeDefProps failed with hr=0x%x\n", hr);
+        return m_unknownId;
+    }
+
+    // Every part comes out of the caches, so a Task<ValueTuple<...>> only queries the
+    // metadata for type arguments that haven't been seen before.
+    string name = m_strings.Get(GetModuleNameId(modId));
+    name += " ";
+    name += ToUtf8(wName);
+
+    ClassEntry entry;
+    entry.moduleId = modId;
+    entry.generic = nTypeArgs > 0;
+    bool argsIncomplete = false;
+
+    if (nTypeArgs > 0)
+    {
+        name += "<";
+    }
+
+    for(ULONG32 i = 0; i < nTypeArgs; i++)
+    {
+        name += m_strings.Get(GetClassNameId(typeArgs[i], &entry.generic, &argsIncomplete));
+
+        if ((i + 1) != nTypeArgs)
+        {
+            name += ", ";
+        }
+    }
+
+    if (nTypeArgs > 0)
+    {
+        name += ">";
+    }
+
+    entry.nameId = m_strings.Intern(name);
+    *isGeneric |= entry.generic;
+
+    if (argsIncomplete)
+    {
+        *incomplete = true;
+        return entry.nameId;
+    }
+
+    std::unique_lock lock(m_lock);
+    m_classNames.emplace(classId, entry);
+    return entry.nameId;
+}
+
+string SymbolCache::GetFunctionName(const FunctionKey &key, bool *isGeneric, bool *incomplete)
+{
+    if (key.functionId == NULL)
+    {
+        return "Unknown_Native_Function";
+    }
+
+    ClassID classId = NULL;
+    ModuleID moduleId = NULL;
+    mdToken token = NULL;
+    ULONG32 nTypeArgs = NULL;
+    ClassID typeArgs[SHORT_LENGTH];
+
+    HRESULT hr = m_pCorProfilerInfo->GetFunctionInfo2(key.functionId,
+                                                   NULL,
+                                                   &classId,
+                                                   &moduleId,
+                                                   &token,
+                                                   SHORT_LENGTH,
+                                                   &nTypeArgs,
+                                                   typeArgs);
+    if (FAILED(hr))
+    {
+        fprintf(m_outputFile, "GetFunctionInfo2 failed with hr=0x%x\n", hr);
+    }
+
+    // The key carries the exact instantiation if the frame told us what it was
+    if (key.classId != NULL)
+    {
+        classId = key.classId;
+    }
+
+    const ClassID *instantiation = typeArgs;
+    if (key.instantiationId != 0)
+    {
+        const vector<ClassID> &methodTypeArgs = m_instantiations.Get(key.instantiationId);
+        instantiation = methodTypeArgs.data();
+        nTypeArgs = (ULONG32)methodTypeArgs.size();
+    }
+
+    IMetaDataImport *pMDImport = m_parent->GetMetadataForModule(moduleId);
+    if (pMDImport == NULL)
+    {
+        return "Unknown";
+    }
+
+    WCHAR funcName[STRING_LENGTH];
+    hr = pMDImport->GetMethodProps(token,
+                                    NULL,
+                                    funcName,
+                                    STRING_LENGTH,
+                                    0,
+                                    0,
+                                    NULL,
+                                    NULL,
+                                    NULL,
+                                    NULL);
+    if (FAILED(hr))
+    {
+        fprintf(m_outputFile, "GetMethodProps failed with hr=0x%x\n", hr);
+        funcName[0] = 0;
+    }
+
+    string name;
+
+    // If the ClassID returned from GetFunctionInfo is 0, then the function is a shared generic function.
+    if (classId != 0)
+    {
+        name += m_strings.Get(GetClassNameId(classId, isGeneric, incomplete));
+    }
+    else
+    {
+        name += "SharedGenericFunction";
+        *isGeneric = true;
+    }
+
+    name += "::";
+
+    name += ToUtf8(funcName);
+
+    // Fill in the type parameters of the generic method
+    if (nTypeArgs > 0)
+    {
+        name += "<";
+        *isGeneric = true;
+    }
+
+    for(ULONG32 i = 0; i < nTypeArgs; i++)
+    {
+        name += m_strings.Get(GetClassNameId(instantiation[i], isGeneric, incomplete));
+
+        if ((i + 1) != nTypeArgs)
+        {
+            name += ", ";
+        }
+    }
+
+    if (nTypeArgs > 0)
+    {
+        name += ">";
+    }
+
+    return name;
+}
+
+bool SymbolCache::GetFunctionInfo(FunctionID funcID, FunctionInfo *info)
+{
+    {
+        std::shared_lock lock(m_lock);
+        auto it = m_functions.find(funcID);
+        if (it != m_functions.end())
+        {
+            *info = it->second;
+            return true;
+        }
+    }
+
+    ClassID classId = NULL;
+    ModuleID moduleId = NULL;
+    mdToken token = NULL;
+    ULONG32 nTypeArgs = 0;
+    HRESULT hr = m_pCorProfilerInfo->GetFunctionInfo2(funcID,
+                                                   NULL,
+                                                   &classId,
+                                                   &moduleId,
+                                                   &token,
+                                                   0,
+                                                   &nTypeArgs,
+                                                   NULL);
+    if (FAILED(hr))
+    {
+        fprintf(m_outputFile, "GetFunctionInfo2 failed with hr=0x%x\n", hr);
+        return false;
+    }
+
+    info->moduleId = moduleId;
+    info->needsFrameInfo = (classId == NULL) || (nTypeArgs > 0);
+
+    std::unique_lock lock(m_lock);
+    m_functions[funcID] = *info;
+    return true;
+}
+
+FunctionKey SymbolCache::GetFunctionKey(FunctionID funcID, COR_PRF_FRAME_INFO frameInfo)
+{
+    FunctionKey key = { funcID, NULL, 0 };
+    if (funcID == NULL || frameInfo == NULL)
+    {
+        return key;
+    }
+
+    FunctionInfo info;
+    if (!GetFunctionInfo(funcID, &info) || !info.needsFrameInfo)
+    {
+        return key;
+    }
+
+    ClassID classId = NULL;
+    ModuleID moduleId = NULL;
+    mdToken token = NULL;
+    ULONG32 nTypeArgs = 0;
+    ClassID typeArgs[SHORT_LENGTH];
+    HRESULT hr = m_pCorProfilerInfo->GetFunctionInfo2(funcID,
+                                                   frameInfo,
+                                                   &classId,
+                                                   &moduleId,
+                                                   &token,
+                                                   SHORT_LENGTH,
+                                                   &nTypeArgs,
+                                                   typeArgs);
+    if (FAILED(hr))
+    {
+        return key;
+    }
+
+    key.classId = classId;
+    if (nTypeArgs > 0)
+    {
+        key.instantiationId = m_instantiations.Intern(vector<ClassID>(typeArgs, typeArgs + std::min<ULONG32>(nTypeArgs, SHORT_LENGTH)));
+    }
+
+    return key;
+}
+
+uint32_t SymbolCache::GetFunctionSymbol(const FunctionKey &key, bool *incomplete)
+{
+    *incomplete = false;
+    {
+        std::shared_lock lock(m_lock);
+        auto it = m_symbols.find(key);
+        if (it != m_symbols.end())
+        {
+            return it->second.symbolId;
+        }
+    }
+
+    SymbolEntry entry;
+    entry.generic = false;
+    entry.symbolId = m_strings.Intern(GetFunctionName(key, &entry.generic, incomplete));
+    entry.moduleId = NULL;
+    if (*incomplete)
+    {
+        return entry.symbolId;
+    }
+
+    FunctionInfo info;
+    if (key.functionId != NULL && GetFunctionInfo(key.functionId, &info))
+    {
+        entry.moduleId = info.moduleId;
+    }
+
+    std::unique_lock lock(m_lock);
+    m_symbols.emplace(key, entry);
+    return entry.symbolId;
+}
+
+void SymbolCache::ModuleUnloaded(ModuleID moduleId)
+{
+    std::unique_lock lock(m_lock);
+
+    // Anything instantiated over a type argument could be closed over a type from the
+    // unloading module and its ClassID can be reused afterwards. Those names are cheap to
+    // rebuild from the cached parts, so they are dropped along with the module's own entries.
+    for (auto it = m_symbols.begin(); it != m_symbols.end(); )
+    {
+        if (it->second.moduleId == moduleId || it->second.generic)
+        {
+            it = m_symbols.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    for (auto it = m_functions.begin(); it != m_functions.end(); )
+    {
+        if (it->second.moduleId == moduleId)
+        {
+            it = m_functions.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    for (auto it = m_classNames.begin(); it != m_classNames.end(); )
+    {
+        if (it->second.moduleId == moduleId || it->second.generic)
+        {
+            it = m_classNames.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    m_moduleNames.erase(moduleId);
+}
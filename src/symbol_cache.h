@@ -0,0 +1,154 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "common.h"
+#include "intern_table.h"
+
+class CorProfiler;
+
+// Identifies one instantiation of a function. For most functions the FunctionID alone is
+// enough and classId/instantiationId are 0. Shared generic code has one FunctionID for many
+// instantiations, so when a frame gives us the exact ClassID and method type arguments they
+// are folded in here. instantiationId indexes the interned list of method type arguments.
+struct FunctionKey
+{
+    FunctionID functionId;
+    ClassID classId;
+    uint32_t instantiationId;
+
+    bool operator==(const FunctionKey &other) const
+    {
+        return functionId == other.functionId
+            && classId == other.classId
+            && instantiationId == other.instantiationId;
+    }
+};
+
+struct FunctionKeyHash
+{
+    size_t operator()(const FunctionKey &key) const
+    {
+        size_t hash = std::hash<uintptr_t>()((uintptr_t)key.functionId);
+        hash ^= std::hash<uintptr_t>()((uintptr_t)key.classId) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        hash ^= std::hash<uint32_t>()(key.instantiationId) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        return hash;
+    }
+};
+
+struct ClassIDListHash
+{
+    size_t operator()(const std::vector<ClassID> &list) const
+    {
+        size_t hash = list.size();
+        for (ClassID classId : list)
+        {
+            hash ^= std::hash<uintptr_t>()((uintptr_t)classId) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        }
+
+        return hash;
+    }
+};
+
+// Maps functions to interned UTF-8 symbol names. A function is resolved through the profiling
+// and metadata APIs the first time it is seen and after that it is a hash lookup, the string
+// is converted to UTF-8 once and shared by every sample that references it.
+//
+// Cache entries are dropped when their module unloads so collectible assemblies don't keep
+// FunctionIDs alive in here. The interned strings themselves are kept, output formats refer
+// to them by ID and those IDs have to stay stable.
+class SymbolCache
+{
+private:
+    struct FunctionInfo
+    {
+        ModuleID moduleId;
+        // True for generic classes/methods, the exact instantiation has to come from the frame
+        bool needsFrameInfo;
+    };
+
+    struct SymbolEntry
+    {
+        uint32_t symbolId;
+        ModuleID moduleId;
+        // The name includes type arguments, which may come from other modules
+        bool generic;
+    };
+
+    struct ClassEntry
+    {
+        uint32_t nameId;
+        ModuleID moduleId;
+        bool generic;
+    };
+
+    ICorProfilerInfo10* m_pCorProfilerInfo;
+    CorProfiler *m_parent;
+    FILE *m_outputFile;
+
+    InternTable<std::string> m_strings;
+    InternTable<std::vector<ClassID>, ClassIDListHash> m_instantiations;
+
+    mutable std::shared_mutex m_lock;
+    std::unordered_map<FunctionID, FunctionInfo> m_functions;
+    std::unordered_map<FunctionKey, SymbolEntry, FunctionKeyHash> m_symbols;
+
+    // Class and module names are cached separately from functions, generic names are built
+    // out of these parts so each type argument is only looked up in metadata once.
+    std::unordered_map<ClassID, ClassEntry> m_classNames;
+    std::unordered_map<ModuleID, uint32_t> m_moduleNames;
+    uint32_t m_unknownId;
+
+    static std::string ToUtf8(const WCHAR *str);
+
+    bool GetFunctionInfo(FunctionID funcID, FunctionInfo *info);
+
+    // incomplete is set if some type in the name hadn't finished loading. Such names aren't
+    // cached, and neither is anything built out of them, so a later sample gets the real name.
+    uint32_t GetClassNameId(ClassID classId, bool *isGeneric, bool *incomplete);
+    uint32_t GetModuleNameId(ModuleID modId);
+    std::string GetFunctionName(const FunctionKey &key, bool *isGeneric, bool *incomplete);
+
+public:
+    SymbolCache(ICorProfilerInfo10* pProfInfo, CorProfiler *parent, FILE *outputFile);
+    ~SymbolCache() = default;
+
+    // Cheap enough to call while the runtime is suspended, for a function we've seen before it
+    // only calls back in to the runtime if the function is generic and frameInfo is available.
+    FunctionKey GetFunctionKey(FunctionID funcID, COR_PRF_FRAME_INFO frameInfo);
+
+    // incomplete is set if the name has a placeholder for a type that was still loading, the
+    // symbol isn't cached and callers shouldn't remember it either
+    uint32_t GetFunctionSymbol(const FunctionKey &key, bool *incomplete);
+    uint32_t GetFunctionSymbol(FunctionID funcID, COR_PRF_FRAME_INFO frameInfo, bool *incomplete)
+    {
+        return GetFunctionSymbol(GetFunctionKey(funcID, frameInfo), incomplete);
+    }
+
+    uint32_t InternString(const std::string &str)
+    {
+        return m_strings.Intern(str);
+    }
+
+    const std::string &GetString(uint32_t id) const
+    {
+        return m_strings.Get(id);
+    }
+
+    // True once names or instantiations have run out of IDs and new ones come back as
+    // "Unknown" or as the non generic function
+    bool Full() const
+    {
+        return m_strings.Full() || m_instantiations.Full();
+    }
+
+    void ModuleUnloaded(ModuleID moduleId);
+};
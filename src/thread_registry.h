@@ -0,0 +1,250 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Fixed capacity, open addressed map from ThreadID to a small value, for data that the sampling
+// thread looks up for every thread on every tick. Find is wait-free: it's at most one pass of
+// acquire loads over the table and never takes a lock. Insert and Remove happen once per
+// thread lifetime and are serialized with a mutex.
+//
+// A removed entry can't be reused straight away, the sampling thread might be in the middle of
+// reading its value. Remove leaves a tombstone, and Reclaim (called by the sampling thread
+// between lookups) turns tombstones in to entries Insert may overwrite. Both kinds still count
+// as occupied when probing, so lookups of other keys keep working. Reclaim also empties any
+// run of reclaimed entries that ends in an empty one, otherwise thread churn would slowly turn
+// the whole table in to reclaimed entries and every Insert and missed Find would scan all of it.
+//
+// That gives the rule for callers: Find may be called from the sampling thread, or from any
+// thread for a key nobody else will remove while it's looking. Keys can't be 0, 1 or 2.
+template <class Value>
+class ThreadRegistry
+{
+private:
+    static constexpr uintptr_t EmptyKey = 0;
+    static constexpr uintptr_t TombstoneKey = 1;
+    static constexpr uintptr_t ReclaimedKey = 2;
+
+    struct Entry
+    {
+        std::atomic<uintptr_t> key;
+        Value value;
+    };
+
+    std::unique_ptr<Entry[]> m_entries;
+    size_t m_mask;
+    std::mutex m_writeLock;
+    size_t m_count;
+    size_t m_tombstones;
+
+    size_t Hash(uintptr_t key) const
+    {
+        // ThreadIDs are aligned pointers, mix the high bits down before masking
+        uint64_t hash = (uint64_t)key * 0x9E3779B97F4A7C15ull;
+        return (size_t)(hash >> 32) & m_mask;
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    ThreadRegistry(size_t capacity) :
+        m_entries(),
+        m_mask(0),
+        m_writeLock(),
+        m_count(0),
+        m_tombstones(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+
+        m_entries = std::unique_ptr<Entry[]>(new Entry[size]);
+        m_mask = size - 1;
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_entries[i].key.store(EmptyKey, std::memory_order_relaxed);
+        }
+    }
+
+    ~ThreadRegistry() = default;
+
+    ThreadRegistry(ThreadRegistry& other) = delete;
+    ThreadRegistry(ThreadRegistry&& other) = delete;
+    ThreadRegistry& operator= (ThreadRegistry& other) = delete;
+    ThreadRegistry& operator= (ThreadRegistry&& other) = delete;
+
+    bool Find(uintptr_t key, Value *value) const
+    {
+        size_t index = Hash(key);
+        for (size_t probes = 0; probes <= m_mask; ++probes)
+        {
+            uintptr_t entryKey = m_entries[index].key.load(std::memory_order_acquire);
+            if (entryKey == key)
+            {
+                *value = m_entries[index].value;
+                return true;
+            }
+
+            if (entryKey == EmptyKey)
+            {
+                return false;
+            }
+
+            index = (index + 1) & m_mask;
+        }
+
+        return false;
+    }
+
+    // Adds or replaces the value for key. Returns false if the table is full.
+    bool Insert(uintptr_t key, const Value &value)
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+
+        // The key has to be looked for all the way to an empty entry before a reclaimed one can
+        // be used, otherwise it could end up in the table twice
+        size_t existingIndex = SIZE_MAX;
+        size_t freeIndex = SIZE_MAX;
+        size_t index = Hash(key);
+        for (size_t probes = 0; probes <= m_mask; ++probes)
+        {
+            uintptr_t entryKey = m_entries[index].key.load(std::memory_order_relaxed);
+            if (entryKey == key)
+            {
+                existingIndex = index;
+            }
+            else if (entryKey == ReclaimedKey && freeIndex == SIZE_MAX)
+            {
+                freeIndex = index;
+            }
+            else if (entryKey == EmptyKey)
+            {
+                if (freeIndex == SIZE_MAX)
+                {
+                    freeIndex = index;
+                }
+
+                break;
+            }
+
+            index = (index + 1) & m_mask;
+        }
+
+        if (freeIndex == SIZE_MAX)
+        {
+            return false;
+        }
+
+        // The value has to be in place before the key is published
+        m_entries[freeIndex].value = value;
+        m_entries[freeIndex].key.store(key, std::memory_order_release);
+        ++m_count;
+
+        if (existingIndex != SIZE_MAX)
+        {
+            // Same thread registered again. The sampling thread may be reading the old value so
+            // it can't be written in place, retire the old entry now the new one is visible.
+            m_entries[existingIndex].key.store(TombstoneKey, std::memory_order_release);
+            ++m_tombstones;
+            --m_count;
+        }
+
+        return true;
+    }
+
+    // Returns false if key wasn't present, otherwise hands back the value it had
+    bool Remove(uintptr_t key, Value *value)
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+
+        size_t index = Hash(key);
+        for (size_t probes = 0; probes <= m_mask; ++probes)
+        {
+            uintptr_t entryKey = m_entries[index].key.load(std::memory_order_relaxed);
+            if (entryKey == key)
+            {
+                *value = m_entries[index].value;
+                m_entries[index].key.store(TombstoneKey, std::memory_order_release);
+                ++m_tombstones;
+                --m_count;
+                return true;
+            }
+
+            if (entryKey == EmptyKey)
+            {
+                return false;
+            }
+
+            index = (index + 1) & m_mask;
+        }
+
+        return false;
+    }
+
+    // Sampling thread only, while it holds no values from Find. Makes everything removed up to
+    // now available to Insert again.
+    void Reclaim()
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+        if (m_tombstones == 0)
+        {
+            return;
+        }
+
+        size_t emptyIndex = SIZE_MAX;
+        for (size_t i = 0; i <= m_mask; ++i)
+        {
+            uintptr_t entryKey = m_entries[i].key.load(std::memory_order_relaxed);
+            if (entryKey == TombstoneKey)
+            {
+                m_entries[i].key.store(ReclaimedKey, std::memory_order_relaxed);
+            }
+            else if (entryKey == EmptyKey)
+            {
+                emptyIndex = i;
+            }
+        }
+
+        m_tombstones = 0;
+
+        if (emptyIndex == SIZE_MAX)
+        {
+            return;
+        }
+
+        // Going backwards round the table from an empty entry, a reclaimed entry followed by an
+        // empty one can be emptied too. Any probe that reached it would have stopped at the next
+        // entry anyway, so this is safe even with a Find running.
+        bool emptyAfter = true;
+        for (size_t n = 1; n <= m_mask; ++n)
+        {
+            size_t index = (emptyIndex - n) & m_mask;
+            uintptr_t entryKey = m_entries[index].key.load(std::memory_order_relaxed);
+            if (entryKey == EmptyKey)
+            {
+                emptyAfter = true;
+            }
+            else if (entryKey == ReclaimedKey && emptyAfter)
+            {
+                m_entries[index].key.store(EmptyKey, std::memory_order_relaxed);
+            }
+            else
+            {
+                emptyAfter = false;
+            }
+        }
+    }
+
+    size_t Count()
+    {
+        std::lock_guard<std::mutex> lock(m_writeLock);
+        return m_count;
+    }
+};
@@ -0,0 +1,78 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <pthread.h>
+#include <sys/types.h>
+
+enum class ThreadState
+{
+    Running = 1,
+    Suspended = 2,
+    Dead = 3
+};
+
+#ifdef __APPLE__
+    typedef pthread_t NativeThreadID;
+#elif __linux__
+    typedef pid_t NativeThreadID;
+#endif
+
+struct ThreadStateInfo
+{
+    ThreadState state;
+    // CPU time the thread has used so far, in nanoseconds
+    uint64_t userNs;
+    uint64_t systemNs;
+};
+
+// Reads the scheduler state and CPU times of threads in this process, cheap enough to call for
+// every thread on every tick.
+//
+// On linux this comes from /proc/self/task/<tid>/stat. The task directory is opened once, each
+// thread's stat file is opened with openat the first time it is read and kept open, and every
+// read after that is a single pread in to a reusable buffer. The kernel regenerates the file on
+// each read from offset 0, so a cached fd always sees current values. On macos it is one
+// proc_pidinfo call.
+//
+// Read is meant to be called from the sampling thread only, Forget can be called from any thread.
+class ThreadStateReader
+{
+private:
+    FILE *m_outputFile;
+
+#ifdef __linux__
+    int m_taskDirectory;
+    uint64_t m_nsPerClockTick;
+    char m_buffer[1024];
+
+    std::mutex m_lock;
+    std::unordered_map<NativeThreadID, int> m_statFiles;
+
+    // Called with m_lock held
+    int GetStatFile(NativeThreadID threadID);
+    bool Parse(size_t length, ThreadStateInfo *info);
+#endif // __linux__
+
+public:
+    ThreadStateReader(FILE *outputFile);
+    ~ThreadStateReader();
+
+    ThreadStateReader(ThreadStateReader& other) = delete;
+    ThreadStateReader(ThreadStateReader&& other) = delete;
+    ThreadStateReader& operator= (ThreadStateReader& other) = delete;
+    ThreadStateReader& operator= (ThreadStateReader&& other) = delete;
+
+    // Returns false if the thread's state couldn't be read, a thread that has exited comes
+    // back as ThreadState::Dead
+    bool Read(NativeThreadID threadID, ThreadStateInfo *info);
+
+    // Drops anything cached for a thread that has gone away
+    void Forget(NativeThreadID threadID);
+};
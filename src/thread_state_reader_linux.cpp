@@ -0,0 +1,180 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "thread_state_reader.h"
+
+ThreadStateReader::ThreadStateReader(FILE *outputFile) :
+    m_outputFile(outputFile),
+    m_taskDirectory(open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+    m_nsPerClockTick(1000000000 / sysconf(_SC_CLK_TCK)),
+    m_buffer(),
+    m_lock(),
+    m_statFiles()
+{
+    if (m_taskDirectory < 0)
+    {
+        fprintf(m_outputFile, "Unable to open /proc/self/task errno=%d, thread states won't be available\n", errno);
+    }
+}
+
+ThreadStateReader::~ThreadStateReader()
+{
+    for (auto &entry : m_statFiles)
+    {
+        close(entry.second);
+    }
+
+    if (m_taskDirectory >= 0)
+    {
+        close(m_taskDirectory);
+    }
+}
+
+int ThreadStateReader::GetStatFile(NativeThreadID threadID)
+{
+    auto it = m_statFiles.find(threadID);
+    if (it != m_statFiles.end())
+    {
+        return it->second;
+    }
+
+    char path[SHORT_LENGTH];
+    snprintf(path, sizeof(path), "%d/stat", (int)threadID);
+    int fd = openat(m_taskDirectory, path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        m_statFiles.emplace(threadID, fd);
+    }
+
+    return fd;
+}
+
+bool ThreadStateReader::Read(NativeThreadID threadID, ThreadStateInfo *info)
+{
+    if (m_taskDirectory < 0)
+    {
+        return false;
+    }
+
+    // Held across the read so Forget can't close the fd (and have the number reused) under us.
+    // The only other taker is ThreadDestroyed, so this is almost never contended.
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    int fd = GetStatFile(threadID);
+    if (fd < 0)
+    {
+        // No directory for the tid means the thread is gone
+        if (errno == ENOENT)
+        {
+            info->state = ThreadState::Dead;
+            info->userNs = 0;
+            info->systemNs = 0;
+            return true;
+        }
+
+        return false;
+    }
+
+    ssize_t length = pread(fd, m_buffer, sizeof(m_buffer) - 1, 0);
+    if (length <= 0)
+    {
+        // Reading a cached fd of an exited thread fails with ESRCH (or returns nothing). The
+        // tid could be reused by a new thread, which the old fd would never show us.
+        close(fd);
+        m_statFiles.erase(threadID);
+
+        info->state = ThreadState::Dead;
+        info->userNs = 0;
+        info->systemNs = 0;
+        return true;
+    }
+
+    m_buffer[length] = '\0';
+    return Parse((size_t)length, info);
+}
+
+bool ThreadStateReader::Parse(size_t length, ThreadStateInfo *info)
+{
+    // The format is "tid (comm) state ppid ...". comm can contain spaces and parens, so the
+    // fields start after the last ')'.
+    char *commEnd = strrchr(m_buffer, ')');
+    if (commEnd == nullptr || commEnd + 2 >= m_buffer + length)
+    {
+        return false;
+    }
+
+    char stateChar = commEnd[2];
+
+    // utime and stime are fields 14 and 15, the state is field 3
+    char *cursor = commEnd + 2;
+    for (int field = 3; field < 14; ++field)
+    {
+        cursor = strchr(cursor, ' ');
+        if (cursor == nullptr)
+        {
+            return false;
+        }
+
+        ++cursor;
+    }
+
+    char *end;
+    uint64_t utime = strtoull(cursor, &end, 10);
+    uint64_t stime = strtoull(end, nullptr, 10);
+
+    info->userNs = utime * m_nsPerClockTick;
+    info->systemNs = stime * m_nsPerClockTick;
+
+    // TODO: should verify that this is completely trustworthy. I did some basic investigation and it seems
+    // to map, i.e. any threads marked as ThreadState::Suspended seemed to be actually suspended.
+    switch (stateChar)
+    {
+        case 'R': // Running
+            info->state = ThreadState::Running;
+            break;
+
+        case 'I': // Idle
+        case 'W': // Paging or waking
+        case 'K': // Wakekill
+        case 'D': // Waiting on disk
+        case 'P': // Parked
+        case 'S': // Sleeping in a wait
+        case 't': // Tracing/debugging
+        case 'T': // Stopped on a signal
+            info->state = ThreadState::Suspended;
+            break;
+
+        case 'x': // dead
+        case 'X': // Dead
+        case 'Z': // Zombie
+            info->state = ThreadState::Dead;
+            break;
+
+        default:
+            fprintf(m_outputFile, "Saw invalid character in thread state %c\n", stateChar);
+            info->state = ThreadState::Running;
+            break;
+    }
+
+    return true;
+}
+
+void ThreadStateReader::Forget(NativeThreadID threadID)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    auto it = m_statFiles.find(threadID);
+    if (it != m_statFiles.end())
+    {
+        close(it->second);
+        m_statFiles.erase(it);
+    }
+}
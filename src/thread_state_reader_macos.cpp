@@ -0,0 +1,64 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <unistd.h>
+#include <libproc.h>
+
+#include "thread_state_reader.h"
+
+ThreadStateReader::ThreadStateReader(FILE *outputFile) :
+    m_outputFile(outputFile)
+{
+
+}
+
+ThreadStateReader::~ThreadStateReader()
+{
+
+}
+
+bool ThreadStateReader::Read(NativeThreadID threadID, ThreadStateInfo *info)
+{
+    pid_t pid = getpid();
+
+    // TODO: why do I have to add the 0xE0?
+    uint64_t nativeThreadID = (uint64_t)threadID | 0xE0;
+    struct proc_threadinfo threadInfo;
+    int result = proc_pidinfo(pid, PROC_PIDTHREADINFO, nativeThreadID, &threadInfo, sizeof(struct proc_threadinfo));
+    if (result != sizeof(struct proc_threadinfo))
+    {
+        fprintf(m_outputFile, "proc_pidinfo returned error for PROC_PIDTHREADINFO result=%d\n", result);
+        return false;
+    }
+
+    // Already in nanoseconds
+    info->userNs = threadInfo.pth_user_time;
+    info->systemNs = threadInfo.pth_system_time;
+
+    switch (threadInfo.pth_run_state)
+    {
+        case TH_STATE_RUNNING:
+        case TH_STATE_UNINTERRUPTIBLE:
+            info->state = ThreadState::Running;
+            break;
+        case TH_STATE_STOPPED:
+            info->state = ThreadState::Dead;
+            break;
+        case TH_STATE_WAITING:
+        case TH_STATE_HALTED:
+            info->state = ThreadState::Suspended;
+            break;
+        default:
+            fprintf(m_outputFile, "Unknown thread state %u\n", threadInfo.pth_run_state);
+            info->state = ThreadState::Running;
+            break;
+    }
+
+    return true;
+}
+
+void ThreadStateReader::Forget(NativeThreadID threadID)
+{
+    // Nothing is cached per thread on macos
+}
@@ -0,0 +1,694 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include "unwind_table.h"
+
+// DWARF register numbers on AMD64
+static constexpr uint64_t DwarfRbp = 6;
+static constexpr uint64_t DwarfRsp = 7;
+
+// Pointer encodings (DW_EH_PE_*) used in .eh_frame
+static constexpr uint8_t EncodingFormatMask = 0x0f;
+static constexpr uint8_t EncodingApplicationMask = 0x70;
+static constexpr uint8_t EncodingPcRelative = 0x10;
+
+namespace
+{
+
+// Bounds checked reads from the section, any read past the end leaves ok false and returns 0
+struct CfiReader
+{
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    bool ok;
+
+    template<class T>
+    T Read()
+    {
+        T value = 0;
+        if (offset > size || size - offset < sizeof(T))
+        {
+            ok = false;
+            offset = size;
+            return 0;
+        }
+
+        memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    uint64_t ReadULEB128()
+    {
+        uint64_t value = 0;
+        unsigned shift = 0;
+        while (offset < size)
+        {
+            uint8_t byte = data[offset++];
+            if (shift < 64)
+            {
+                value |= (uint64_t)(byte & 0x7f) << shift;
+            }
+
+            shift += 7;
+            if ((byte & 0x80) == 0)
+            {
+                return value;
+            }
+        }
+
+        ok = false;
+        return 0;
+    }
+
+    int64_t ReadSLEB128()
+    {
+        int64_t value = 0;
+        unsigned shift = 0;
+        while (offset < size)
+        {
+            uint8_t byte = data[offset++];
+            if (shift < 64)
+            {
+                value |= (int64_t)((uint64_t)(byte & 0x7f) << shift);
+            }
+
+            shift += 7;
+            if ((byte & 0x80) == 0)
+            {
+                if (shift < 64 && (byte & 0x40) != 0)
+                {
+                    value |= -((int64_t)1 << shift);
+                }
+
+                return value;
+            }
+        }
+
+        ok = false;
+        return 0;
+    }
+
+    void Skip(uint64_t count)
+    {
+        if (offset > size || count > size - offset)
+        {
+            ok = false;
+            offset = size;
+            return;
+        }
+
+        offset += (size_t)count;
+    }
+
+    // Reads a pointer in the given DW_EH_PE encoding. Only absolute and pc relative values can
+    // be resolved, anything else is still skipped over but reports false.
+    bool ReadPointer(uint8_t encoding, uintptr_t sectionAddress, uintptr_t *pointer, bool ignoreApplication = false)
+    {
+        uintptr_t fieldAddress = sectionAddress + offset;
+        uint64_t value;
+        switch (encoding & EncodingFormatMask)
+        {
+            case 0x00: value = Read<uint64_t>(); break;
+            case 0x01: value = ReadULEB128(); break;
+            case 0x02: value = Read<uint16_t>(); break;
+            case 0x03: value = Read<uint32_t>(); break;
+            case 0x04: value = Read<uint64_t>(); break;
+            case 0x09: value = (uint64_t)ReadSLEB128(); break;
+            case 0x0a: value = (uint64_t)(int64_t)Read<int16_t>(); break;
+            case 0x0b: value = (uint64_t)(int64_t)Read<int32_t>(); break;
+            case 0x0c: value = Read<uint64_t>(); break;
+            default:
+                ok = false;
+                return false;
+        }
+
+        if (!ok)
+        {
+            return false;
+        }
+
+        if (!ignoreApplication)
+        {
+            switch (encoding & EncodingApplicationMask)
+            {
+                case 0x00: break;
+                case EncodingPcRelative: value += fieldAddress; break;
+                default: return false;
+            }
+        }
+
+        *pointer = (uintptr_t)value;
+        return true;
+    }
+};
+
+struct RegisterRule
+{
+    enum class Kind : uint8_t
+    {
+        Unchanged,
+        Offset,
+        Unsupported
+    };
+
+    Kind kind;
+    int64_t offset;
+};
+
+struct CfiState
+{
+    CfaRegister cfaRegister;
+    int64_t cfaOffset;
+    RegisterRule rbp;
+    RegisterRule returnAddress;
+};
+
+struct CommonInfo
+{
+    bool valid;
+    uint64_t codeAlignment;
+    int64_t dataAlignment;
+    uint64_t returnAddressRegister;
+    uint8_t pointerEncoding;
+    bool hasAugmentationData;
+    size_t instructions;
+    size_t instructionsEnd;
+};
+
+// The rules a CIE's instructions leave behind are where every FDE using it starts from, and
+// what DW_CFA_restore goes back to.
+class CfiProgram
+{
+private:
+    const uint8_t *m_section;
+    uintptr_t m_sectionAddress;
+    const CommonInfo &m_cie;
+    std::vector<CfiState> m_rememberedStates;
+
+    RegisterRule *GetRule(CfiState *state, uint64_t reg)
+    {
+        if (reg == DwarfRbp)
+        {
+            return &state->rbp;
+        }
+
+        return reg == m_cie.returnAddressRegister ? &state->returnAddress : nullptr;
+    }
+
+    void RestoreRule(CfiState *state, const CfiState &initial, uint64_t reg)
+    {
+        if (reg == DwarfRbp)
+        {
+            state->rbp = initial.rbp;
+        }
+        else if (reg == m_cie.returnAddressRegister)
+        {
+            state->returnAddress = initial.returnAddress;
+        }
+    }
+
+    void SetRule(CfiState *state, uint64_t reg, RegisterRule::Kind kind, int64_t offset)
+    {
+        RegisterRule *rule = GetRule(state, reg);
+        if (rule != nullptr)
+        {
+            rule->kind = kind;
+            rule->offset = offset;
+        }
+    }
+
+public:
+    CfiProgram(const uint8_t *section, uintptr_t sectionAddress, const CommonInfo &cie) :
+        m_section(section),
+        m_sectionAddress(sectionAddress),
+        m_cie(cie),
+        m_rememberedStates()
+    {
+
+    }
+
+    // Runs the instructions in [start, end). Every time the location moves on, addRow is
+    // called with the rules for the range it moved past. Returns false on anything that isn't
+    // understood, state is then only good up to location.
+    template<class AddRow>
+    bool Run(size_t start, size_t end, const CfiState &initial, CfiState *state, uintptr_t *location, AddRow addRow)
+    {
+        CfiReader reader = { m_section, end, start, true };
+        while (reader.offset < end)
+        {
+            uint8_t op = reader.Read<uint8_t>();
+            uint64_t advance = 0;
+            uint64_t reg;
+            switch (op >> 6)
+            {
+                case 1:
+                    advance = (op & 0x3f) * m_cie.codeAlignment;
+                    break;
+                case 2:
+                    SetRule(state, op & 0x3f, RegisterRule::Kind::Offset, (int64_t)reader.ReadULEB128() * m_cie.dataAlignment);
+                    break;
+                case 3:
+                    RestoreRule(state, initial, op & 0x3f);
+                    break;
+                default:
+                    switch (op)
+                    {
+                        case 0x00: // nop
+                            break;
+                        case 0x01: // set_loc
+                        {
+                            uintptr_t newLocation;
+                            if (!reader.ReadPointer(m_cie.pointerEncoding, m_sectionAddress, &newLocation) || newLocation < *location)
+                            {
+                                return false;
+                            }
+
+                            advance = newLocation - *location;
+                            break;
+                        }
+                        case 0x02: advance = reader.Read<uint8_t>() * m_cie.codeAlignment; break;
+                        case 0x03: advance = reader.Read<uint16_t>() * m_cie.codeAlignment; break;
+                        case 0x04: advance = reader.Read<uint32_t>() * m_cie.codeAlignment; break;
+                        case 0x05: // offset_extended
+                            reg = reader.ReadULEB128();
+                            SetRule(state, reg, RegisterRule::Kind::Offset, (int64_t)reader.ReadULEB128() * m_cie.dataAlignment);
+                            break;
+                        case 0x06: // restore_extended
+                            RestoreRule(state, initial, reader.ReadULEB128());
+                            break;
+                        case 0x07: // undefined
+                        case 0x09: // register, the second operand is skipped below
+                            reg = reader.ReadULEB128();
+                            SetRule(state, reg, RegisterRule::Kind::Unsupported, 0);
+                            if (op == 0x09)
+                            {
+                                reader.ReadULEB128();
+                            }
+                            break;
+                        case 0x08: // same_value
+                            SetRule(state, reader.ReadULEB128(), RegisterRule::Kind::Unchanged, 0);
+                            break;
+                        case 0x0a: // remember_state
+                            m_rememberedStates.push_back(*state);
+                            break;
+                        case 0x0b: // restore_state
+                            if (m_rememberedStates.empty())
+                            {
+                                return false;
+                            }
+
+                            *state = m_rememberedStates.back();
+                            m_rememberedStates.pop_back();
+                            break;
+                        case 0x0c: // def_cfa
+                            reg = reader.ReadULEB128();
+                            state->cfaRegister = reg == DwarfRsp ? CfaRegister::Rsp : reg == DwarfRbp ? CfaRegister::Rbp : CfaRegister::Undefined;
+                            state->cfaOffset = (int64_t)reader.ReadULEB128();
+                            break;
+                        case 0x0d: // def_cfa_register
+                            reg = reader.ReadULEB128();
+                            state->cfaRegister = reg == DwarfRsp ? CfaRegister::Rsp : reg == DwarfRbp ? CfaRegister::Rbp : CfaRegister::Undefined;
+                            break;
+                        case 0x0e: // def_cfa_offset
+                            state->cfaOffset = (int64_t)reader.ReadULEB128();
+                            break;
+                        case 0x0f: // def_cfa_expression
+                            state->cfaRegister = CfaRegister::Undefined;
+                            reader.Skip(reader.ReadULEB128());
+                            break;
+                        case 0x10: // expression
+                        case 0x16: // val_expression
+                            reg = reader.ReadULEB128();
+                            SetRule(state, reg, RegisterRule::Kind::Unsupported, 0);
+                            reader.Skip(reader.ReadULEB128());
+                            break;
+                        case 0x11: // offset_extended_sf
+                            reg = reader.ReadULEB128();
+                            SetRule(state, reg, RegisterRule::Kind::Offset, reader.ReadSLEB128() * m_cie.dataAlignment);
+                            break;
+                        case 0x12: // def_cfa_sf
+                            reg = reader.ReadULEB128();
+                            state->cfaRegister = reg == DwarfRsp ? CfaRegister::Rsp : reg == DwarfRbp ? CfaRegister::Rbp : CfaRegister::Undefined;
+                            state->cfaOffset = reader.ReadSLEB128() * m_cie.dataAlignment;
+                            break;
+                        case 0x13: // def_cfa_offset_sf
+                            state->cfaOffset = reader.ReadSLEB128() * m_cie.dataAlignment;
+                            break;
+                        case 0x14: // val_offset
+                            reg = reader.ReadULEB128();
+                            SetRule(state, reg, RegisterRule::Kind::Unsupported, 0);
+                            reader.ReadULEB128();
+                            break;
+                        case 0x15: // val_offset_sf
+                            reg = reader.ReadULEB128();
+                            SetRule(state, reg, RegisterRule::Kind::Unsupported, 0);
+                            reader.ReadSLEB128();
+                            break;
+                        case 0x2e: // GNU_args_size, doesn't affect where anything is
+                            reader.ReadULEB128();
+                            break;
+                        case 0x2f: // GNU_negative_offset_extended
+                            reg = reader.ReadULEB128();
+                            SetRule(state, reg, RegisterRule::Kind::Offset, -(int64_t)reader.ReadULEB128() * m_cie.dataAlignment);
+                            break;
+                        default:
+                            return false;
+                    }
+                    break;
+            }
+
+            if (!reader.ok)
+            {
+                return false;
+            }
+
+            if (advance != 0)
+            {
+                addRow(*location, *state);
+                *location += advance;
+            }
+        }
+
+        return true;
+    }
+};
+
+CommonInfo ParseCommonInfo(const uint8_t *section, size_t size, size_t offset)
+{
+    CommonInfo cie = {};
+
+    CfiReader reader = { section, size, offset, true };
+    uint64_t length = reader.Read<uint32_t>();
+    if (length == 0xffffffff)
+    {
+        length = reader.Read<uint64_t>();
+    }
+
+    if (!reader.ok || length > size - reader.offset)
+    {
+        return cie;
+    }
+
+    size_t end = reader.offset + (size_t)length;
+    reader.size = end;
+    if (reader.Read<uint32_t>() != 0)
+    {
+        return cie;
+    }
+
+    uint8_t version = reader.Read<uint8_t>();
+    const char *augmentation = (const char *)section + reader.offset;
+    size_t augmentationLength = strnlen(augmentation, end - reader.offset);
+    reader.Skip(augmentationLength + 1);
+    if (!reader.ok || (version != 1 && version != 3 && version != 4))
+    {
+        return cie;
+    }
+
+    if (version == 4)
+    {
+        // address_size and segment_selector_size
+        reader.Skip(2);
+    }
+
+    cie.codeAlignment = reader.ReadULEB128();
+    cie.dataAlignment = reader.ReadSLEB128();
+    cie.returnAddressRegister = version == 1 ? reader.Read<uint8_t>() : reader.ReadULEB128();
+
+    if (augmentationLength > 0)
+    {
+        // Without the 'z' length the FDEs can't be skipped past their augmentation data
+        if (augmentation[0] != 'z')
+        {
+            return cie;
+        }
+
+        cie.hasAugmentationData = true;
+        uint64_t dataLength = reader.ReadULEB128();
+        size_t dataEnd = reader.offset + (size_t)dataLength;
+        for (size_t i = 1; i < augmentationLength && reader.ok; ++i)
+        {
+            switch (augmentation[i])
+            {
+                case 'R':
+                    cie.pointerEncoding = reader.Read<uint8_t>();
+                    break;
+                case 'P':
+                {
+                    // The personality routine, only needed for exceptions
+                    uint8_t encoding = reader.Read<uint8_t>();
+                    uintptr_t ignored;
+                    reader.ReadPointer(encoding & 0x7f, 0, &ignored, true);
+                    break;
+                }
+                case 'L':
+                    reader.Read<uint8_t>();
+                    break;
+                default:
+                    // 'S', 'B' and anything newer have no data we need, the length gets
+                    // us past them
+                    break;
+            }
+        }
+
+        if (dataEnd > end)
+        {
+            return cie;
+        }
+
+        reader.offset = dataEnd;
+    }
+
+    if (!reader.ok || cie.codeAlignment == 0)
+    {
+        return cie;
+    }
+
+    cie.instructions = reader.offset;
+    cie.instructionsEnd = end;
+    cie.valid = true;
+    return cie;
+}
+
+bool RuleFromState(const CfiState &state, UnwindRule *rule)
+{
+    if (state.cfaRegister == CfaRegister::Undefined
+        || state.cfaOffset < INT32_MIN || state.cfaOffset > INT32_MAX
+        || state.returnAddress.kind != RegisterRule::Kind::Offset
+        || state.returnAddress.offset < INT8_MIN || state.returnAddress.offset > INT8_MAX
+        || state.rbp.kind == RegisterRule::Kind::Unsupported
+        || state.rbp.offset < INT16_MIN || state.rbp.offset > INT16_MAX)
+    {
+        return false;
+    }
+
+    rule->cfaRegister = state.cfaRegister;
+    rule->cfaOffset = (int32_t)state.cfaOffset;
+    rule->rbpOffset = state.rbp.kind == RegisterRule::Kind::Offset ? (int32_t)state.rbp.offset : 0;
+    rule->returnAddressOffset = (int32_t)state.returnAddress.offset;
+    return true;
+}
+
+} // namespace
+
+UnwindTable::UnwindTable() :
+    m_rows()
+{
+
+}
+
+void UnwindTable::AddRow(uintptr_t start, const UnwindRule &rule)
+{
+    if (start > UINT32_MAX)
+    {
+        return;
+    }
+
+    Row row;
+    row.start = (uint32_t)start;
+    row.cfaOffset = rule.cfaOffset;
+    row.rbpOffset = (int16_t)rule.rbpOffset;
+    row.returnAddressOffset = (int8_t)rule.returnAddressOffset;
+    row.cfaRegister = rule.cfaRegister;
+
+    // A zero length range is overwritten by whatever follows it
+    if (!m_rows.empty() && m_rows.back().start == row.start)
+    {
+        m_rows.back() = row;
+    }
+    else
+    {
+        m_rows.push_back(row);
+    }
+}
+
+size_t UnwindTable::Build(const uint8_t *section, size_t size, uintptr_t sectionAddress)
+{
+    m_rows.clear();
+
+    const UnwindRule undefined = { CfaRegister::Undefined, 0, 0, 0 };
+    std::unordered_map<size_t, CommonInfo> cies;
+
+    size_t offset = 0;
+    while (offset < size)
+    {
+        CfiReader reader = { section, size, offset, true };
+        uint64_t length = reader.Read<uint32_t>();
+        if (length == 0)
+        {
+            // Terminator
+            break;
+        }
+
+        if (length == 0xffffffff)
+        {
+            length = reader.Read<uint64_t>();
+        }
+
+        if (!reader.ok || length > size - reader.offset)
+        {
+            break;
+        }
+
+        size_t entryEnd = reader.offset + (size_t)length;
+        offset = entryEnd;
+        reader.size = entryEnd;
+
+        size_t cieFieldOffset = reader.offset;
+        uint32_t cieDelta = reader.Read<uint32_t>();
+        if (!reader.ok || cieDelta == 0 || cieDelta > cieFieldOffset)
+        {
+            // A CIE, they're parsed when an FDE refers to them
+            continue;
+        }
+
+        size_t cieOffset = cieFieldOffset - cieDelta;
+        auto found = cies.find(cieOffset);
+        if (found == cies.end())
+        {
+            found = cies.emplace(cieOffset, ParseCommonInfo(section, size, cieOffset)).first;
+        }
+
+        const CommonInfo &cie = found->second;
+        if (!cie.valid)
+        {
+            continue;
+        }
+
+        uintptr_t start;
+        uintptr_t range;
+        if (!reader.ReadPointer(cie.pointerEncoding, sectionAddress, &start)
+            || !reader.ReadPointer(cie.pointerEncoding & EncodingFormatMask, sectionAddress, &range)
+            || start == 0
+            || range == 0)
+        {
+            continue;
+        }
+
+        if (cie.hasAugmentationData)
+        {
+            reader.Skip(reader.ReadULEB128());
+        }
+
+        if (!reader.ok)
+        {
+            continue;
+        }
+
+        // Start from the rules the CIE sets up, then run the FDE's own instructions
+        CfiProgram program(section, sectionAddress, cie);
+        CfiState initial = { CfaRegister::Undefined, 0, { RegisterRule::Kind::Unchanged, 0 }, { RegisterRule::Kind::Unsupported, 0 } };
+        uintptr_t location = start;
+        auto ignoreRow = [](uintptr_t, const CfiState &) { };
+        if (!program.Run(cie.instructions, cie.instructionsEnd, initial, &initial, &location, ignoreRow))
+        {
+            continue;
+        }
+
+        CfiState state = initial;
+        location = start;
+        uintptr_t end = start + range;
+        auto addRow = [this, end, &undefined](uintptr_t rowStart, const CfiState &rowState)
+        {
+            UnwindRule rule;
+            if (rowStart < end)
+            {
+                AddRow(rowStart, RuleFromState(rowState, &rule) ? rule : undefined);
+            }
+        };
+
+        bool complete = program.Run(reader.offset, entryEnd, initial, &state, &location, addRow);
+        if (location < end)
+        {
+            UnwindRule rule;
+            AddRow(location, complete && RuleFromState(state, &rule) ? rule : undefined);
+        }
+
+        // Nothing is known past the end of the function, unless another FDE starts right there
+        AddRow(end, undefined);
+    }
+
+    // FDEs aren't in address order. Where one function's end marker lands on the start of the
+    // next, the next one's real rule wins.
+    std::stable_sort(m_rows.begin(), m_rows.end(),
+        [](const Row &left, const Row &right)
+        {
+            if (left.start != right.start)
+            {
+                return left.start < right.start;
+            }
+
+            return left.cfaRegister != CfaRegister::Undefined && right.cfaRegister == CfaRegister::Undefined;
+        });
+    m_rows.erase(std::unique(m_rows.begin(), m_rows.end(),
+        [](const Row &left, const Row &right) { return left.start == right.start; }),
+        m_rows.end());
+
+    // Neighbouring rows with the same rule are one range
+    m_rows.erase(std::unique(m_rows.begin(), m_rows.end(),
+        [](const Row &left, const Row &right)
+        {
+            return left.cfaRegister == right.cfaRegister
+                && left.cfaOffset == right.cfaOffset
+                && left.rbpOffset == right.rbpOffset
+                && left.returnAddressOffset == right.returnAddressOffset;
+        }),
+        m_rows.end());
+
+    m_rows.shrink_to_fit();
+    return m_rows.size();
+}
+
+bool UnwindTable::Find(uintptr_t address, UnwindRule *rule) const
+{
+    if (address > UINT32_MAX)
+    {
+        return false;
+    }
+
+    auto it = std::upper_bound(m_rows.begin(), m_rows.end(), (uint32_t)address,
+        [](uint32_t value, const Row &row) { return value < row.start; });
+    if (it == m_rows.begin())
+    {
+        return false;
+    }
+
+    --it;
+    if (it->cfaRegister == CfaRegister::Undefined)
+    {
+        return false;
+    }
+
+    rule->cfaRegister = it->cfaRegister;
+    rule->cfaOffset = it->cfaOffset;
+    rule->rbpOffset = it->rbpOffset;
+    rule->returnAddressOffset = it->returnAddressOffset;
+    return true;
+}
@@ -0,0 +1,73 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class CfaRegister : uint8_t
+{
+    // No usable rule, the caller has to guess (i.e. follow RBP)
+    Undefined,
+    Rsp,
+    Rbp
+};
+
+// How to get from a frame to its caller at one instruction, AMD64 only. The canonical frame
+// address (CFA) is the caller's RSP, the return address and the caller's RBP are read from
+// the stack relative to it.
+struct UnwindRule
+{
+    CfaRegister cfaRegister;
+    int32_t cfaOffset;
+    // 0 if RBP still holds the caller's value
+    int32_t rbpOffset;
+    int32_t returnAddressOffset;
+};
+
+// The .eh_frame CFI of one native object boiled down to just what a stack walk needs.
+//
+// .eh_frame is a list of small programs (one per function, plus shared prologues) describing
+// where each register was saved at every instruction. Running them on every frame would be far
+// too slow, so Build runs them all once and keeps a row per address where the rule changes,
+// sorted by address. Finding the rule for an IP is then a binary search.
+//
+// Only the rules compilers emit for ordinary AMD64 code are understood: CFA as RSP or RBP plus
+// an offset, and RBP and the return address saved at an offset from the CFA. Anything else
+// (DWARF expressions, registers saved in other registers) becomes an Undefined row.
+class UnwindTable
+{
+private:
+    struct Row
+    {
+        // Relative to the object's load bias, i.e. the address in the file
+        uint32_t start;
+        int32_t cfaOffset;
+        int16_t rbpOffset;
+        int8_t returnAddressOffset;
+        CfaRegister cfaRegister;
+    };
+
+    std::vector<Row> m_rows;
+
+    void AddRow(uintptr_t start, const UnwindRule &rule);
+
+public:
+    UnwindTable();
+    ~UnwindTable() = default;
+
+    UnwindTable(UnwindTable& other) = delete;
+    UnwindTable(UnwindTable&& other) = delete;
+    UnwindTable& operator= (UnwindTable& other) = delete;
+    UnwindTable& operator= (UnwindTable&& other) = delete;
+
+    // section is the contents of .eh_frame, sectionAddress where it is in the object (sh_addr),
+    // which pc relative pointers in it are measured from. Returns the number of rows.
+    size_t Build(const uint8_t *section, size_t size, uintptr_t sectionAddress);
+
+    // address is relative to the load bias. False if there's no usable rule for it.
+    bool Find(uintptr_t address, UnwindRule *rule) const;
+};
@@ -0,0 +1,124 @@
+// Licensed to the .NET Foundation under one or more agreements.
+// The .NET Foundation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Fixed capacity lock free queue, any number of threads can push and pop at once.
+//
+// Every cell carries a sequence number that says whose turn it is: a pusher may fill cell i
+// when its sequence is the position being pushed, a popper may empty it when it's one past
+// that. Claiming a position is a single compare exchange on the push or pop counter, so
+// neither side ever waits on the other. When the queue is full or empty the Try methods just
+// return false and the caller decides what to do.
+template<class Value>
+class WorkQueue
+{
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        Value value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    size_t m_mask;
+
+    // On their own cache lines, pushers and poppers are usually different threads
+    alignas(64) std::atomic<size_t> m_pushPosition;
+    alignas(64) std::atomic<size_t> m_popPosition;
+
+public:
+    // capacity is rounded up to a power of 2
+    WorkQueue(size_t capacity) :
+        m_cells(),
+        m_mask(0),
+        m_pushPosition(0),
+        m_popPosition(0)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+
+        m_cells = std::unique_ptr<Cell[]>(new Cell[size]);
+        m_mask = size - 1;
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~WorkQueue() = default;
+
+    WorkQueue(WorkQueue& other) = delete;
+    WorkQueue(WorkQueue&& other) = delete;
+    WorkQueue& operator= (WorkQueue& other) = delete;
+    WorkQueue& operator= (WorkQueue&& other) = delete;
+
+    // Returns false if the queue is full
+    bool TryPush(const Value &value)
+    {
+        size_t position = m_pushPosition.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = m_cells[position & m_mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+            if (difference == 0)
+            {
+                if (m_pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    cell.value = value;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                // The cell still holds the value from a lap ago
+                return false;
+            }
+            else
+            {
+                position = m_pushPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns false if the queue is empty
+    bool TryPop(Value *value)
+    {
+        size_t position = m_popPosition.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = m_cells[position & m_mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+            if (difference == 0)
+            {
+                if (m_popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    *value = cell.value;
+                    // Free for the push one lap from now
+                    cell.sequence.store(position + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_popPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};